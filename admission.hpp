@@ -0,0 +1,213 @@
+#ifndef ADMISSION_HPP_
+#define ADMISSION_HPP_
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <utility>
+#include "basic.hpp"
+
+namespace pika
+{
+
+// Admission control shared by every acceptor in the process.
+// Concurrency caps reject (close) the accepted connection, while the
+// accept rate and memory budget only defer the next accept so the
+// kernel listen backlog absorbs the overflow. Limits may be replaced
+// at runtime; acceptors pick them up on their next accept.
+// Every admitted connection is charged the buffers its current stage
+// holds (handshake, waiting for a dial-back, bridge), not just bridges.
+class admission
+{
+public:
+    struct limits
+    {
+        std::size_t max_bridges        {0}; // global, 0 means unlimited
+        std::size_t max_tunnel_bridges {0}; // per listener, 0 means unlimited
+        double      accept_rate        {0}; // accepts per second per listener, 0 means unlimited
+        std::size_t memory_budget      {0}; // bytes, 0 means unlimited
+    };
+
+private:
+    std::shared_ptr<limits const> limits_ {std::make_shared<limits const>()};
+    std::atomic<std::size_t>   bridges_  {0};
+    std::atomic<std::size_t>   memory_   {0};
+    std::atomic<std::uint64_t> accepted_ {0};
+    std::atomic<std::uint64_t> rejected_ {0};
+    std::atomic<std::uint64_t> deferred_ {0};
+
+public:
+    // Holds one admitted connection and the memory charged for it, released when the connection dies.
+    class ticket
+    {
+        admission * owner_ {nullptr};
+        std::shared_ptr<std::atomic<std::size_t>> tunnel_;
+        std::size_t cost_ {0};
+    public:
+        ticket() = default;
+        ticket(admission * owner, std::shared_ptr<std::atomic<std::size_t>> tunnel, std::size_t cost):
+            owner_{owner},
+            tunnel_{std::move(tunnel)},
+            cost_{cost} {}
+
+        ticket(ticket && other) noexcept:
+            owner_{std::exchange(other.owner_, nullptr)},
+            tunnel_{std::move(other.tunnel_)},
+            cost_{other.cost_} {}
+
+        ticket& operator = (ticket && other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                owner_  = std::exchange(other.owner_, nullptr);
+                tunnel_ = std::move(other.tunnel_);
+                cost_   = other.cost_;
+            }
+            return *this;
+        }
+
+        ticket(ticket const &) = delete;
+        ticket& operator = (ticket const &) = delete;
+        ~ticket() { release(); }
+
+        explicit operator bool() const { return owner_ != nullptr; }
+
+        // The connection moved on to a stage holding `cost` bytes, e.g. a bridge
+        void charge(std::size_t cost)
+        {
+            if (not owner_)
+                return;
+            owner_->memory_ += cost;
+            owner_->memory_ -= cost_;
+            cost_ = cost;
+        }
+
+        void release()
+        {
+            if (not owner_)
+                return;
+            owner_->bridges_--;
+            owner_->memory_ -= cost_;
+            (*tunnel_)--;
+            owner_ = nullptr;
+            tunnel_.reset();
+        }
+    };
+
+    // Per-listener state: bridge count and accept-rate token bucket.
+    // A gate is driven by the coroutine owning the acceptor, so only the
+    // counter shared with the tickets needs to be atomic.
+    class gate
+    {
+        using clock = std::chrono::steady_clock;
+        admission & owner_;
+        std::shared_ptr<std::atomic<std::size_t>> bridges_;
+        std::size_t cap_ {0};
+        double tokens_;
+        clock::time_point last_refill_;
+    public:
+        explicit gate(admission & owner):
+            owner_{owner},
+            bridges_{std::make_shared<std::atomic<std::size_t>>(0)},
+            tokens_{owner.get_limits().accept_rate},
+            last_refill_{clock::now()} {}
+
+        std::size_t bridges() const { return *bridges_; }
+
+        // Per-listener bridge cap below max_tunnel_bridges, 0 to use the default
+        void cap(std::size_t max_bridges) { cap_ = max_bridges; }
+        std::size_t cap() const { return cap_; }
+
+        // Suspends until the next accept is allowed by the memory budget and accept rate.
+        lib::awaitable<void> wait()
+        {
+            using namespace std::chrono_literals;
+            auto executor = co_await lib::this_coro::executor();
+            auto token    = co_await lib::this_coro::token();
+
+            bool deferred = false;
+            for (;;)
+            {
+                std::chrono::milliseconds pause {0};
+                if (owner_.over_budget())
+                    pause = 50ms;
+                else if (double const rate = owner_.get_limits().accept_rate; rate > 0)
+                {
+                    auto const now = clock::now();
+                    std::chrono::duration<double> const elapsed = now - last_refill_;
+                    last_refill_ = now;
+                    tokens_ = std::min(std::max(rate, 1.0), tokens_ + elapsed.count() * rate);
+                    if (tokens_ < 1)
+                        pause = std::chrono::milliseconds{static_cast<long>((1 - tokens_) * 1000 / rate) + 1};
+                    else
+                        tokens_ -= 1;
+                }
+
+                if (pause == 0ms)
+                    break;
+
+                if (not std::exchange(deferred, true))
+                    owner_.deferred_++;
+                boost::asio::steady_timer t{executor.context(), pause};
+                co_await t.async_wait(token);
+            }
+        }
+
+        // Returns an empty ticket when a concurrency cap is hit; the caller drops the connection.
+        ticket admit(std::size_t cost = def::bridge_cost)
+        {
+            limits const l = owner_.get_limits();
+            // a client's own cap may only lower the server's
+            std::size_t const tunnel_cap = cap_ && l.max_tunnel_bridges? std::min(cap_, l.max_tunnel_bridges):
+                                                                          std::max(cap_, l.max_tunnel_bridges);
+            // reserve, then check: the embedded socks5 server admits from another thread
+            std::size_t const total = owner_.bridges_.fetch_add(1);
+            std::size_t const own   = bridges_->fetch_add(1);
+            if ((l.max_bridges && total >= l.max_bridges) ||
+                (tunnel_cap    && own   >= tunnel_cap))
+            {
+                owner_.bridges_--;
+                (*bridges_)--;
+                owner_.rejected_++;
+                return {};
+            }
+            owner_.memory_ += cost;
+            owner_.accepted_++;
+            return ticket{&owner_, bridges_, cost};
+        }
+    };
+
+    admission() = default;
+    explicit admission(limits const & l): limits_{std::make_shared<limits const>(l)} {}
+
+    limits get_limits() const { return *std::atomic_load(&limits_); }
+    void   set_limits(limits const & l) { std::atomic_store(&limits_, std::make_shared<limits const>(l)); }
+    std::size_t    bridges()    const { return bridges_; }
+    std::uint64_t  accepted()   const { return accepted_; }
+    std::uint64_t  rejected()   const { return rejected_; }
+    std::uint64_t  deferred()   const { return deferred_; }
+    std::size_t    memory_in_use() const { return memory_; }
+
+    bool over_budget() const
+    {
+        std::size_t const budget = get_limits().memory_budget;
+        return budget && memory_in_use() + def::bridge_cost > budget;
+    }
+
+    void report(std::ostream & os) const
+    {
+        os << "admission: bridges "  << bridges()
+           << ", memory "            << memory_in_use() << "/" << get_limits().memory_budget
+           << ", accepted "          << accepted()
+           << ", rejected "          << rejected()
+           << ", deferred "          << deferred() << "\n";
+    }
+};
+
+}// namespace pika
+
+#endif // ADMISSION_HPP_
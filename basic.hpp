@@ -7,7 +7,13 @@
 #include <boost/endian/conversion.hpp>
 #include <boost/asio.hpp>
 #include <boost/scope_exit.hpp>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <memory>
 
 namespace pika
 {
@@ -15,6 +21,9 @@ namespace pika
 namespace lib {
 
 using boost::asio::ip::tcp;
+using local   = boost::asio::local::stream_protocol;
+using generic = boost::asio::generic::stream_protocol; // a stream socket of either family
+using generic_acceptor = boost::asio::basic_socket_acceptor<generic>;
 using boost::asio::experimental::co_spawn;
 using boost::asio::experimental::detached;
 namespace this_coro = boost::asio::experimental::this_coro;
@@ -29,11 +38,97 @@ namespace def
 
 constexpr int bufsize = 4 * 1024;
 
+// Rough footprints charged against the memory budget
+constexpr std::size_t socket_cost = 1024;                       // a connection without buffers of ours: socket, coroutine frame, bookkeeping
+constexpr std::size_t tls_cost    = 40 * 1024;                  // a connection in its TLS handshake: OpenSSL's record buffers
+constexpr std::size_t bridge_cost = 2 * bufsize + socket_cost;  // two relay buffers
+
+constexpr std::chrono::seconds handshake_timeout {10}; // a new control connection must finish its handshake and first frame
+constexpr std::chrono::seconds dial_back_timeout {30}; // a waiting public connection is dropped without its dial-back
+
 }// namespace def
 
 namespace util
 {
 
+// Counts live objects of one kind, so long runs can check for leaks
+template <typename Tag>
+class counted
+{
+    static inline std::atomic<std::size_t> live_ {0};
+public:
+    counted()                { live_++; }
+    counted(counted const &) { live_++; }
+    ~counted()               { live_--; }
+    counted& operator = (counted const &) = default;
+
+    static std::size_t live() { return live_; }
+};
+
+// Bounds-checked big-endian reader over received bytes; running past
+// the end clears ok() instead of throwing, so parsers can ask for more.
+class reader
+{
+    std::string_view data_;
+    std::size_t pos_ {0};
+    bool ok_ {true};
+public:
+    explicit reader(std::string_view data): data_{data} {}
+
+    bool ok()              const { return ok_; }
+    bool empty()           const { return pos_ >= data_.size(); }
+    std::size_t position() const { return pos_; }
+
+    std::size_t number(std::size_t width)
+    {
+        if (not ok_ || data_.size() - pos_ < width)
+        {
+            ok_ = false;
+            return 0;
+        }
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < width; i++)
+            n = n << 8 | static_cast<std::uint8_t>(data_[pos_++]);
+        return n;
+    }
+
+    std::string_view bytes(std::size_t n)
+    {
+        if (not ok_ || data_.size() - pos_ < n)
+        {
+            ok_ = false;
+            return {};
+        }
+        std::string_view const out = data_.substr(pos_, n);
+        pos_ += n;
+        return out;
+    }
+
+    void skip(std::size_t n) { bytes(n); }
+};
+
+// Runs `expire` once the duration passed, unless the deadline was destroyed
+// first, e.g. to close a socket whose peer stalls a handshake.
+class deadline
+{
+    std::shared_ptr<std::function<void()>> expire_;
+    boost::asio::steady_timer timer_;
+public:
+    deadline(boost::asio::io_context &io_context, std::chrono::steady_clock::duration after, std::function<void()> expire):
+        expire_{std::make_shared<std::function<void()>>(std::move(expire))},
+        timer_{io_context, after}
+    {
+        // a handler already queued when the deadline goes away must not run it
+        timer_.async_wait([weak = std::weak_ptr<std::function<void()>>{expire_}](boost::system::error_code const & ec) {
+            if (auto f = weak.lock(); f && not ec)
+                (*f)();
+        });
+    }
+
+    deadline(deadline const &) = delete;
+    deadline& operator = (deadline const &) = delete;
+};
+
 inline
 std::size_t hash(boost::asio::ip::tcp::endpoint const &e)
 {
@@ -56,6 +151,64 @@ lib::tcp::endpoint make_connectable(std::string_view host, boost::asio::io_conte
     return *resolver.resolve(server_host, server_port);
 }
 
+constexpr std::string_view unix_prefix {"unix:"};
+
+inline
+bool is_local(std::string_view host)
+{
+    return host.substr(0, unix_prefix.size()) == unix_prefix;
+}
+
+// "unix:/path" names a unix domain socket, anything else is "host:port"
+inline
+lib::generic::endpoint make_endpoint(std::string_view host, boost::asio::io_context &io_context)
+{
+    if (is_local(host))
+        return lib::local::endpoint{std::string{host.substr(unix_prefix.size())}};
+    return make_connectable(host, io_context);
+}
+
+inline
+std::string to_string(lib::generic::endpoint const &e)
+{
+    if (e.protocol().family() == AF_UNIX)
+        return std::string{unix_prefix} + reinterpret_cast<sockaddr_un const *>(e.data())->sun_path;
+
+    lib::tcp::endpoint tcp_ep;
+    tcp_ep.resize(e.size());
+    std::memcpy(tcp_ep.data(), e.data(), e.size());
+    std::ostringstream stream;
+    stream << tcp_ep;
+    return stream.str();
+}
+
+// A listening socket on either family. A unix socket file left behind by
+// a previous run is replaced; anything else at the path is left alone.
+inline
+lib::generic_acceptor make_listener(boost::asio::io_context &io_context, lib::generic::endpoint const &e)
+{
+    if (e.protocol().family() == AF_UNIX)
+    {
+        std::string const path = reinterpret_cast<sockaddr_un const *>(e.data())->sun_path;
+        struct stat st {};
+        if (::lstat(path.c_str(), &st) == 0)
+        {
+            if (not S_ISSOCK(st.st_mode))
+                throw std::runtime_error(path + " exists and is not a socket");
+
+            // non-blocking: a listener with a full backlog must not hang us
+            lib::generic::socket probe{io_context, e.protocol()};
+            probe.non_blocking(true);
+            boost::system::error_code ec;
+            probe.connect(e, ec);
+            if (ec != boost::asio::error::connection_refused)
+                throw std::runtime_error(path + " is in use by a running process");
+            ::unlink(path.c_str());
+        }
+    }
+    return lib::generic_acceptor{io_context, e};
+}
+
 }// namespace util
 
 namespace error
@@ -74,6 +227,7 @@ namespace error
 
         virtual char const * what() const noexcept override { return "Restart Requested\n"; }
         void sleep() const {std::this_thread::sleep_for(waittime_);}
+        std::chrono::seconds waittime() const {return waittime_;}
         operator bool() {return not empty_;};
     };
 } // namespace error
@@ -0,0 +1,272 @@
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include "controller.hpp"
+#include "client.hpp"
+#include "socks5_server.hpp"
+
+// Loopback throughput of one tunnel: writer -> controller -> client -> sink.
+// Run once plain and once with the --tls-* options (with and without --no-ktls) to compare,
+// and with --unix to carry the control, dial-back and export hops over unix sockets.
+// --socks5-handshakes instead times CONNECT handshakes against the socks5 server.
+
+namespace
+{
+
+using namespace pika;
+
+std::uint16_t free_port(boost::asio::io_context &io_context)
+{
+    lib::tcp::acceptor acceptor{io_context, lib::tcp::endpoint{boost::asio::ip::address_v4::loopback(), 0}};
+    return acceptor.local_endpoint().port();
+}
+
+lib::awaitable<void> sink(lib::generic_acceptor & acceptor, std::size_t & received)
+{
+    auto token = co_await lib::this_coro::token();
+    lib::generic::socket socket = co_await acceptor.async_accept(token);
+    std::array<char, 64 * 1024> buf;
+    for (;;)
+    {
+        try
+        {
+            received += co_await socket.async_read_some(boost::asio::buffer(buf), token);
+        }
+        catch (boost::system::system_error const &)
+        {
+            break;
+        }
+    }
+}
+
+lib::awaitable<void> writer(lib::tcp::endpoint target, std::size_t total,
+                            std::chrono::steady_clock::time_point & started)
+{
+    using namespace std::chrono_literals;
+    auto executor = co_await lib::this_coro::executor();
+    auto token    = co_await lib::this_coro::token();
+
+    // give the client time to bind the tunnel
+    boost::asio::steady_timer t{executor.context(), 500ms};
+    co_await t.async_wait(token);
+
+    lib::tcp::socket socket{executor.context()};
+    co_await socket.async_connect(target, token);
+    std::vector<char> chunk(64 * 1024, 'x');
+    started = std::chrono::steady_clock::now();
+    for (std::size_t sent = 0; sent < total;)
+    {
+        std::size_t const n = std::min(chunk.size(), total - sent);
+        sent += co_await boost::asio::async_write(socket, boost::asio::buffer(chunk.data(), n), token);
+    }
+    socket.shutdown(lib::tcp::socket::shutdown_send);
+}
+
+lib::awaitable<void> watch(std::size_t & received, std::size_t total,
+                           std::chrono::steady_clock::time_point & finished)
+{
+    using namespace std::chrono_literals;
+    auto executor = co_await lib::this_coro::executor();
+    auto token    = co_await lib::this_coro::token();
+    while (received < total)
+    {
+        boost::asio::steady_timer t{executor.context(), 1ms};
+        co_await t.async_wait(token);
+    }
+    finished = std::chrono::steady_clock::now();
+    executor.context().stop();
+}
+
+// Accepts the socks5 targets and drops them, which ends each session's bridge
+lib::awaitable<void> drop(lib::tcp::acceptor & acceptor)
+{
+    auto token = co_await lib::this_coro::token();
+    for (;;)
+        lib::tcp::socket socket = co_await acceptor.async_accept(token);
+}
+
+// One CONNECT per connection, from the greeting to the request's reply, in microseconds.
+// Lockstep waits for each reply before the next message, pipelined writes greeting and request at once.
+lib::awaitable<void> handshakes(lib::tcp::endpoint proxy, lib::tcp::endpoint target, std::size_t count,
+                                bool pipelined, std::vector<double> & latencies)
+{
+    auto executor = co_await lib::this_coro::executor();
+    auto token    = co_await lib::this_coro::token();
+
+    std::array<std::uint8_t, 3>  const greeting{0x05, 0x01, 0x00};
+    std::array<std::uint8_t, 10> request{0x05, 0x01 /* CONNECT */, 0x00, 0x01 /* IP V4 */};
+    auto const ip = target.address().to_v4().to_bytes();
+    std::copy(ip.begin(), ip.end(), &request[4]);
+    request[8] = static_cast<std::uint8_t>(target.port() >> 8);
+    request[9] = static_cast<std::uint8_t>(target.port() & 0xFF);
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+        lib::tcp::socket socket{executor.context()};
+        co_await socket.async_connect(proxy, token);
+        socket.set_option(lib::tcp::no_delay{true});
+
+        std::array<std::uint8_t, 2>  method;
+        std::array<std::uint8_t, 10> reply;
+        auto const begin = std::chrono::steady_clock::now();
+        if (pipelined)
+        {
+            std::array<boost::asio::const_buffer, 2> const both{boost::asio::buffer(greeting), boost::asio::buffer(request)};
+            std::array<boost::asio::mutable_buffer, 2> const replies{boost::asio::buffer(method), boost::asio::buffer(reply)};
+            std::ignore = co_await boost::asio::async_write(socket, both, token);
+            std::ignore = co_await boost::asio::async_read(socket, replies, token);
+        }
+        else
+        {
+            std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(greeting), token);
+            std::ignore = co_await boost::asio::async_read(socket, boost::asio::buffer(method), token);
+            std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(request), token);
+            std::ignore = co_await boost::asio::async_read(socket, boost::asio::buffer(reply), token);
+        }
+        latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+        if (method[1] != 0x00 || reply[1] != 0x00)
+            throw std::runtime_error("socks5 handshake refused");
+    }
+}
+
+double percentile(std::vector<double> & samples, double p)
+{
+    if (samples.empty())
+        return 0;
+    std::size_t const n = static_cast<std::size_t>(p * (samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + n, samples.end());
+    return samples[n];
+}
+
+int bench_handshakes(std::size_t count)
+{
+    boost::asio::io_context io_context;
+    lib::tcp::endpoint const proxy {boost::asio::ip::address_v4::loopback(), free_port(io_context)};
+    lib::tcp::acceptor target_acceptor {io_context, lib::tcp::endpoint{boost::asio::ip::address_v4::loopback(), 0}};
+    lib::tcp::endpoint const target = target_acceptor.local_endpoint();
+
+    admission admit;
+    socks5::server server{"127.0.0.1:" + std::to_string(proxy.port()), io_context, admit};
+    std::vector<double> lockstep, pipelined;
+    bool done {false};
+
+    lib::co_spawn(io_context, [&] { return server.run(); }, lib::detached);
+    lib::co_spawn(io_context, [&] { return drop(target_acceptor); }, lib::detached);
+    lib::co_spawn(io_context, [&]() -> lib::awaitable<void> {
+                      try
+                      {
+                          co_await handshakes(proxy, target, count, false, lockstep);
+                          co_await handshakes(proxy, target, count, true,  pipelined);
+                          done = true;
+                      }
+                      catch (std::exception const & e)
+                      {
+                          std::cerr << "handshakes exception: " << e.what() << std::endl;
+                      }
+                      io_context.stop();
+                  }, lib::detached);
+    io_context.run();
+    if (not done)
+        return 1;
+
+    for (auto & [name, samples] : {std::pair{"lockstep ", &lockstep}, std::pair{"pipelined", &pipelined}})
+        std::cout << "socks5 " << name << ": " << count << " handshakes, p50 "
+                  << percentile(*samples, 0.50) << " us, p99 " << percentile(*samples, 0.99) << " us\n";
+    return 0;
+}
+
+}// namespace
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        namespace po = boost::program_options;
+        std::size_t megabytes {1024};
+        tls::options tls_options;
+
+        po::options_description desc{"Options"};
+        desc.add_options()
+            ("help,h", "Print this help messages")
+            ("megabytes,m", po::value<std::size_t>(&megabytes)->default_value(1024), "bytes to push through the tunnel, in MiB")
+            ("tls-cert", po::value<std::string>(&tls_options.cert), "controller certificate chain, enables TLS")
+            ("tls-key",  po::value<std::string>(&tls_options.key),  "private key of --tls-cert")
+            ("tls-ca",   po::value<std::string>(&tls_options.ca),   "CA the client verifies the controller with")
+            ("no-ktls",  "keep TLS record encryption in userspace")
+            ("unix",     "connect controller and export over unix domain sockets instead of loopback TCP")
+            ("socks5-handshakes", po::value<std::size_t>(), "time this many socks5 CONNECT handshakes, lockstep and pipelined, instead");
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (vm.count("help"))
+        {
+            std::cout << desc << "\n";
+            return 0;
+        }
+        if (vm.count("socks5-handshakes"))
+            return bench_handshakes(vm["socks5-handshakes"].as<std::size_t>());
+        tls_options.ktls = not vm.count("no-ktls");
+
+        boost::asio::io_context io_context;
+        std::shared_ptr<tls::context> controller_tls, client_tls;
+        if (not tls_options.cert.empty())
+        {
+            controller_tls = std::make_shared<tls::context>(tls_options, tls::context::role::controller);
+            // the controller asks for a client certificate when given a CA, the client shows the same one
+            tls::options client_options{tls_options.cert, tls_options.key, tls_options.ca, tls_options.ktls};
+            client_tls = std::make_shared<tls::context>(client_options, tls::context::role::client);
+        }
+
+        bool const use_unix = vm.count("unix");
+        auto socket_path = [](char const * name) {
+            return std::string{util::unix_prefix} +
+                (std::filesystem::temp_directory_path() / ("reverse-tunnel-bench-" + std::to_string(::getpid()) + name)).string();
+        };
+        std::string const export_host  = use_unix? socket_path("-export.sock"):  "127.0.0.1:" + std::to_string(free_port(io_context));
+        std::string const control_host = use_unix? socket_path("-control.sock"): "127.0.0.1:" + std::to_string(free_port(io_context));
+        lib::generic_acceptor sink_acceptor = util::make_listener(io_context, util::make_endpoint(export_host, io_context));
+        std::uint16_t const public_port = free_port(io_context);
+        std::string const bind_host    = "127.0.0.1:" + std::to_string(public_port);
+
+        std::size_t const total = megabytes * 1024 * 1024;
+        std::size_t received {0};
+        std::chrono::steady_clock::time_point started, finished;
+
+        admission admit;
+        controller server{control_host, io_context, admit, controller_tls};
+        auto c = std::make_shared<client>(export_host, io_context, client_tls);
+        error::restart_request req;
+
+        lib::co_spawn(io_context, [&] { return server.run(); }, lib::detached);
+        lib::co_spawn(io_context, [&] { return c->run(control_host, bind_host, req); }, lib::detached);
+        lib::co_spawn(io_context, [&] { return sink(sink_acceptor, received); }, lib::detached);
+        lib::co_spawn(io_context, [&] {
+                          return writer(lib::tcp::endpoint{boost::asio::ip::address_v4::loopback(), public_port},
+                                        total, started);
+                      }, lib::detached);
+        lib::co_spawn(io_context, [&] { return watch(received, total, finished); }, lib::detached);
+        io_context.run();
+        if (use_unix)
+            for (std::string const & host : {export_host, control_host})
+                std::filesystem::remove(host.substr(util::unix_prefix.size()));
+
+        if (received < total)
+        {
+            std::cerr << "tunnel broke after " << received << " of " << total << " bytes\n";
+            return 1;
+        }
+
+        std::chrono::duration<double> const elapsed = finished - started;
+        std::cout << (use_unix? "unix socket, ": "loopback tcp, ")
+                  << (controller_tls? (tls_options.ktls? "tls (ktls when available)": "tls (userspace)"): "plaintext")
+                  << ": " << megabytes << " MiB in " << elapsed.count() << " s, "
+                  << megabytes / elapsed.count() << " MiB/s\n";
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception: " <<  e.what() << std::endl;
+        return 1;
+    }
+}
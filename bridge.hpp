@@ -1,22 +1,31 @@
 #ifndef BRIDGE_HPP_
 #define BRIDGE_HPP_
 
+#include "admission.hpp"
+#include "trace.hpp"
+
 namespace pika
 {
 
-class bridge : public std::enable_shared_from_this<bridge>
+struct bridge_tag {};
+
+template <typename First, typename Second = First>
+class basic_bridge : public std::enable_shared_from_this<basic_bridge<First, Second>>,
+                     public util::counted<bridge_tag>
 {
 public:
-    lib::tcp::socket first_socket_;
-    lib::tcp::socket second_socket_;
+    First first_socket_;
+    Second second_socket_;
+    admission::ticket ticket_;
+    std::shared_ptr<trace::span> span_;
 
-    bridge (lib::tcp::socket && f, lib::tcp::socket && s) :
+    basic_bridge (First && f, Second && s) :
         first_socket_{std::move(f)},
         second_socket_{std::move(s)} {}
 
     lib::awaitable<void> start_transport()
     {
-        auto self     = shared_from_this();
+        auto self     = this->shared_from_this();
         auto executor = co_await lib::this_coro::executor();
 
         lib::co_spawn(executor,
@@ -32,17 +41,23 @@ public:
     }
 
 private:
-    lib::awaitable<void> redir(lib::tcp::socket &from, lib::tcp::socket &to)
+    template <typename From, typename To>
+    lib::awaitable<void> redir(From &from, To &to)
     {
         auto executor = co_await lib::this_coro::executor();
         auto token    = co_await lib::this_coro::token();
-        auto self     = shared_from_this();
+        auto self     = this->shared_from_this();
         try
         {
             std::array<char, def::bufsize> raw_buf;
             for (;;)
             {
                 std::size_t read_n = co_await from.async_read_some(boost::asio::buffer(raw_buf), token);
+                if (span_)
+                {
+                    span_->mark(trace::stage::first_byte);
+                    span_.reset();
+                }
                 std::ignore = co_await boost::asio::async_write(to, boost::asio::buffer(raw_buf, read_n), token);
             }
         }
@@ -56,12 +71,14 @@ private:
             std::cerr << "bridge::redir() std exception: " << e.what() << std::endl;
         }
         boost::system::error_code ec;
-        from.shutdown(lib::tcp::socket::shutdown_both, ec);
-        to.shutdown(lib::tcp::socket::shutdown_both, ec);
+        from.lowest_layer().shutdown(lib::tcp::socket::shutdown_both, ec);
+        to.lowest_layer().shutdown(lib::tcp::socket::shutdown_both, ec);
         co_return;
     }
 };
 
+using bridge = basic_bridge<lib::tcp::socket>;
+
 } // namespace pika
 
 #endif // BRIDGE_HPP_
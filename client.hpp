@@ -3,81 +3,56 @@
 
 #pragma once
 
+#include <map>
 #include "basic.hpp"
+#include "bridge.hpp"
+#include "config.hpp"
+#include "keepalive.hpp"
+#include "route.hpp"
+#include "tls.hpp"
+#include "trace.hpp"
 
 namespace pika
 {
 
 class client : public std::enable_shared_from_this<client>
 {
-    lib::tcp::endpoint export_ep_;
-    lib::tcp::endpoint controller_ep_;
+    using tunnel_bridge = basic_bridge<lib::generic::socket, tls::stream>;
+
+    boost::asio::io_context &io_;
+    lib::generic::endpoint export_ep_;
+    lib::generic::endpoint controller_ep_;
+    std::string controller_name_;
+    std::shared_ptr<tls::context> tls_;
+    std::shared_ptr<trace::collector> tracer_;
+    keepalive::settings keepalive_;
+    std::uint32_t max_bridges_ {0};
+    std::shared_ptr<tls::stream> control_;
+    std::shared_ptr<keepalive::probe> probe_;
+    boost::asio::steady_timer retry_timer_;
+    bool stopped_ {false};
 
 public:
-    client(std::string_view export_host, boost::asio::io_context &io_context):
-        export_ep_{util::make_connectable(export_host, io_context)} {}
+    client(std::string_view export_host, boost::asio::io_context &io_context,
+           std::shared_ptr<tls::context> tls = nullptr,
+           std::shared_ptr<trace::collector> tracer = nullptr,
+           keepalive::settings const & keepalive = {}):
+        io_{io_context},
+        export_ep_{util::make_endpoint(export_host, io_context)},
+        tls_{std::move(tls)},
+        tracer_{std::move(tracer)},
+        keepalive_{keepalive},
+        retry_timer_{io_context} {}
 
     lib::awaitable<void> run(std::string_view controller_host,
                              std::string_view controller_bind,
                              error::restart_request &req)
     {
         auto executor = co_await lib::this_coro::executor();
-        auto token    = co_await lib::this_coro::token();
 
         try
         {
-            auto self     = shared_from_this();
-
-            self->controller_ep_ = util::make_connectable(controller_host, executor.context());
-            lib::tcp::socket controller_socket{executor.context()};
-            co_await controller_socket.async_connect(self->controller_ep_, token);
-
-            auto controller_bind_ep = util::make_connectable(controller_bind, executor.context());
-            { // send bind request
-                std::uint32_t ip   = controller_bind_ep.address().to_v4().to_ulong();
-                boost::endian::native_to_big_inplace(ip);
-                std::uint16_t port = controller_bind_ep.port();
-                boost::endian::native_to_big_inplace(port);
-
-                std::array<std::uint8_t, 8> req{0x01, 0x00};
-                std::memcpy(&req[2]            , &ip,   sizeof ip);
-                std::memcpy(&req[2 + sizeof ip], &port, sizeof port);
-                std::ignore = co_await boost::asio::async_write(controller_socket, boost::asio::buffer(req), token);
-            }
-
-            for (;;)
-            {
-                std::array<std::uint8_t, 8> buf{};
-                std::size_t length = co_await boost::asio::async_read(controller_socket, boost::asio::buffer(buf), token);
-
-                if (buf.at(1) != 0)
-                {
-                    std::cout << "Error connecting to remote server\n";
-                    using namespace std::chrono_literals;
-                    throw error::restart_request{1s};
-                }
-                else
-                {
-                    switch(buf.at(0))
-                    {
-                        case 0x00: // do nothing
-                            break;
-                        case 0x02: // Is remote request
-                        {
-                            std::uint32_t id = 0;
-                            std::memcpy(&id, &buf[2], 4);
-                            lib::co_spawn(executor,
-                                          [self, id]() mutable {
-                                              return self->make_bridge(id);
-                                          }, lib::detached);
-                            break;
-                        }
-                        default:
-                            // response failed
-                            break;
-                    }
-                }
-            }
+            co_await session(controller_host, controller_bind);
         }
         catch (error::restart_request const & e)
         {
@@ -97,7 +72,83 @@ public:
         req = error::restart_request{1s};
     }
 
-    lib::awaitable<void> make_bridge(std::uint32_t const id)
+    // Keeps the tunnel up until stop(), reconnecting on its own instead of
+    // stopping the io_context, so tunnels sharing the process are unaffected.
+    lib::awaitable<void> serve(std::string controller_host, std::string controller_bind)
+    {
+        using namespace std::chrono_literals;
+        auto token = co_await lib::this_coro::token();
+        auto self  = shared_from_this();
+
+        while (not stopped_)
+        {
+            std::chrono::seconds wait {1s};
+            try
+            {
+                co_await session(controller_host, controller_bind);
+            }
+            catch (error::restart_request const & e)
+            {
+                wait = e.waittime();
+            }
+            catch (std::exception const & e)
+            {
+                if (not stopped_)
+                    std::cerr << "client::serve() exception: " << e.what() << std::endl;
+            }
+
+            if (stopped_)
+                break;
+            try
+            {
+                retry_timer_.expires_after(wait);
+                co_await retry_timer_.async_wait(token);
+            }
+            catch (boost::system::system_error const &) {}
+        }
+        std::cout << "tunnel " << controller_bind << " removed\n";
+    }
+
+    // Drops the control connection; bridges already relaying keep going
+    void stop()
+    {
+        stopped_ = true;
+        retry_timer_.cancel();
+        if (control_)
+        {
+            boost::system::error_code ec;
+            control_->lowest_layer().close(ec);
+        }
+    }
+
+    // New connections go to the new export endpoint, existing bridges are untouched
+    void set_export(std::string_view export_host)
+    {
+        export_ep_ = util::make_endpoint(export_host, io_);
+    }
+
+    // Round trip to the controller, as measured by our pings
+    void report(std::ostream & os) const
+    {
+        if (not probe_)
+        {
+            os << "not connected";
+            return;
+        }
+        probe_->report(os);
+    }
+
+    void set_max_bridges(std::uint32_t max_bridges)
+    {
+        if (std::exchange(max_bridges_, max_bridges) == max_bridges || not control_)
+            return;
+        lib::co_spawn(io_,
+                      [self = shared_from_this(), control = control_]() mutable {
+                          return self->send_limit(std::move(control));
+                      }, lib::detached);
+    }
+
+    lib::awaitable<void> make_bridge(std::uint32_t const id, std::shared_ptr<trace::span> span)
     {
         try
         {
@@ -105,16 +156,35 @@ public:
             auto token    = co_await lib::this_coro::token();
             auto self     = shared_from_this();
 
-            auto proxy_bridge = std::make_shared<bridge>(lib::tcp::socket{executor.context()},
-                                                   lib::tcp::socket{executor.context()});
-            lib::tcp::socket
-                & export_socket{proxy_bridge->first_socket_},
-                & controller_socket{proxy_bridge->second_socket_};
-            co_await export_socket.async_connect(self->export_ep_, token);
-            co_await controller_socket.async_connect(self->controller_ep_, token);
-            std::array<std::uint8_t, 8> req{0x02, 0x00};
+            auto proxy_bridge = std::make_shared<tunnel_bridge>(lib::generic::socket{executor.context()},
+                                                                tls::stream{lib::generic::socket{executor.context()}});
+            lib::generic::socket & export_socket{proxy_bridge->first_socket_};
+            tls::stream & controller_socket{proxy_bridge->second_socket_};
+            bool refused = false;
+            try
+            {
+                co_await export_socket.async_connect(self->export_ep_, token);
+            }
+            catch (boost::system::system_error const & e)
+            {
+                std::cerr << "client::make_bridge() export unreachable: " << e.what() << std::endl;
+                refused = true;
+            }
+            if (span)
+                span->mark(refused? trace::stage::export_failed: trace::stage::export_connected);
+            co_await controller_socket.lowest_layer().async_connect(self->controller_ep_, token);
+            if (tls_)
+                co_await controller_socket.handshake(*tls_, boost::asio::ssl::stream_base::client, controller_name_);
+            if (span)
+                span->mark(trace::stage::dialback_connected);
+
+            // a failed dial-back lets the server drop the waiting public connection
+            std::array<std::uint8_t, 8> req{0x02, refused? std::uint8_t{0x01} /* FAILED */: std::uint8_t{0x00}};
             std::memcpy(&req[2], &id, sizeof id);
-            std::ignore = co_await boost::asio::async_write(controller_socket, boost::asio::buffer(req), token);
+            co_await controller_socket.write_frame(req);
+            if (refused)
+                co_return;
+            proxy_bridge->span_ = std::move(span);
             co_await proxy_bridge->start_transport();
         }
         catch (std::exception const & e)
@@ -122,6 +192,213 @@ public:
             std::cerr << "client::make_bridge() exception: " << e.what() << std::endl;
         }
     }
+
+private:
+    lib::awaitable<void> session(std::string_view controller_host, std::string_view controller_bind)
+    {
+        auto executor = co_await lib::this_coro::executor();
+        auto token    = co_await lib::this_coro::token();
+
+        auto self     = shared_from_this();
+        self->controller_ep_   = util::make_endpoint(controller_host, executor.context());
+        if (tls_)
+            self->controller_name_ = tls::server_name(controller_host);
+        auto control = std::make_shared<tls::stream>(lib::generic::socket{executor.context()});
+        tls::stream & controller_socket = *control;
+        co_await controller_socket.lowest_layer().async_connect(self->controller_ep_, token);
+        boost::system::error_code ec; // meaningless on unix sockets
+        controller_socket.lowest_layer().set_option(lib::tcp::no_delay{true}, ec); // pongs must not wait for an ACK
+        if (tls_)
+            co_await controller_socket.handshake(*tls_, boost::asio::ssl::stream_base::client, controller_name_);
+        std::cout << "connected to " << util::to_string(self->controller_ep_) << " (" << controller_socket.mode() << ")\n";
+
+        auto probe = std::make_shared<keepalive::probe>(keepalive_);
+        self->control_ = control;
+        self->probe_   = probe;
+        BOOST_SCOPE_EXIT (self, control) {
+            // also ends the pings, which hold on to the connection
+            boost::system::error_code ec;
+            control->lowest_layer().close(ec);
+            self->control_.reset();
+            self->probe_.reset();
+        } BOOST_SCOPE_EXIT_END;
+        if (stopped_)
+            co_return;
+
+        if (route::is_route(controller_bind))
+            co_await controller_socket.write_frames(route::request(controller_bind.substr(route::prefix.size())));
+        else
+        { // send bind request
+            auto controller_bind_ep = util::make_connectable(controller_bind, executor.context());
+            std::uint32_t ip   = controller_bind_ep.address().to_v4().to_ulong();
+            boost::endian::native_to_big_inplace(ip);
+            std::uint16_t port = controller_bind_ep.port();
+            boost::endian::native_to_big_inplace(port);
+
+            std::array<std::uint8_t, 8> req{0x01, 0x00};
+            std::memcpy(&req[2]            , &ip,   sizeof ip);
+            std::memcpy(&req[2 + sizeof ip], &port, sizeof port);
+            co_await controller_socket.write_frame(req);
+        }
+        if (max_bridges_)
+            co_await send_limit(control);
+        lib::co_spawn(executor,
+                      [control, probe]() mutable {
+                          return keep_alive(std::move(control), std::move(probe));
+                      }, lib::detached);
+
+        for (;;)
+        {
+            std::array<std::uint8_t, 8> buf{};
+            std::size_t length = co_await boost::asio::async_read(controller_socket, boost::asio::buffer(buf), token);
+            probe->heard(buf);
+
+            if (buf.at(1) != 0)
+            {
+                std::cout << "Error connecting to remote server\n";
+                using namespace std::chrono_literals;
+                throw error::restart_request{1s};
+            }
+            else
+            {
+                switch(buf.at(0))
+                {
+                    case 0x00: // do nothing
+                        break;
+                    case 0x04: // Ping
+                        co_await controller_socket.write_frame(keepalive::pong(buf));
+                        break;
+                    case 0x05: // Pong
+                        probe->pong(buf);
+                        break;
+                    case 0x02: // Is remote request
+                    {
+                        std::uint32_t id = 0;
+                        std::memcpy(&id, &buf[2], 4);
+                        std::shared_ptr<trace::span> span;
+                        if (tracer_ && buf.at(6) == 0x01 /* TRACED */)
+                        {
+                            span = tracer_->follow(boost::endian::big_to_native(id), "client");
+                            span->mark(trace::stage::notice_received);
+                        }
+                        lib::co_spawn(executor,
+                                      [self, id, span]() mutable {
+                                          return self->make_bridge(id, std::move(span));
+                                      }, lib::detached);
+                        break;
+                    }
+                    default:
+                        // response failed
+                        break;
+                }
+            }
+        }
+    }
+
+    // A controller that stops answering pings is reconnected to without
+    // waiting for TCP to give up on the connection
+    static
+    lib::awaitable<void> keep_alive(std::shared_ptr<tls::stream> control, std::shared_ptr<keepalive::probe> probe)
+    {
+        try
+        {
+            co_await keepalive::watch(*control, *probe);
+            if (probe->missed())
+                std::cerr << "client::keep_alive() controller missed " << probe->missed() << " pongs, reconnecting" << std::endl;
+            else
+                std::cerr << "client::keep_alive() controller went silent, reconnecting" << std::endl;
+        }
+        catch (std::exception const &) {} // the session sees the connection fail by itself
+        boost::system::error_code ec;
+        control->lowest_layer().close(ec);
+    }
+
+    lib::awaitable<void> send_limit(std::shared_ptr<tls::stream> control)
+    {
+        try
+        {
+            std::uint32_t max_bridges = max_bridges_;
+            boost::endian::native_to_big_inplace(max_bridges);
+            std::array<std::uint8_t, 8> req{0x03 /* TUNNEL LIMIT */, 0x00};
+            std::memcpy(&req[2], &max_bridges, sizeof max_bridges);
+            co_await control->write_frame(req);
+        }
+        catch (std::exception const & e)
+        {
+            std::cerr << "client::send_limit() exception: " << e.what() << std::endl;
+        }
+    }
+};
+
+// The tunnels of a config file, one client each. A reload only touches
+// the tunnels whose declaration changed.
+class client_pool
+{
+    using key = std::pair<std::string, std::string>; // {connect, bind}
+
+    boost::asio::io_context &io_;
+    std::shared_ptr<tls::context> tls_;
+    std::shared_ptr<trace::collector> tracer_;
+    keepalive::settings keepalive_;
+    std::map<key, std::shared_ptr<client>> clients_;
+public:
+    client_pool(boost::asio::io_context &io_context,
+                std::shared_ptr<tls::context> tls = nullptr,
+                std::shared_ptr<trace::collector> tracer = nullptr,
+                keepalive::settings const & keepalive = {}):
+        io_{io_context},
+        tls_{std::move(tls)},
+        tracer_{std::move(tracer)},
+        keepalive_{keepalive} {}
+
+    void report(std::ostream & os) const
+    {
+        for (auto const & [k, c] : clients_)
+        {
+            os << "tunnel " << k.second << ": ";
+            c->report(os);
+            os << "\n";
+        }
+    }
+
+    void reconfigure(config::settings const & cfg)
+    {
+        if (tls_)
+            tls::server_name(cfg.connect); // throws before anything changes
+        std::map<key, std::shared_ptr<client>> next;
+        for (config::tunnel const & t : cfg.tunnels)
+        {
+            key k {cfg.connect, t.bind};
+            try
+            {
+                if (auto it = clients_.find(k); it != clients_.end())
+                {
+                    std::shared_ptr<client> c = it->second;
+                    next.insert(clients_.extract(it));
+                    c->set_export(t.export_host);
+                    c->set_max_bridges(t.max_bridges);
+                    continue;
+                }
+
+                auto c = std::make_shared<client>(t.export_host, io_, tls_, tracer_, keepalive_);
+                c->set_max_bridges(t.max_bridges);
+                lib::co_spawn(io_,
+                              [c, k] {
+                                  return c->serve(k.first, k.second);
+                              }, lib::detached);
+                std::cout << "tunnel " << t.bind << " -> " << t.export_host << " added\n";
+                next.emplace(k, c);
+            }
+            catch (std::exception const & e)
+            {
+                std::cerr << "client_pool::reconfigure " << t.bind << ": " << e.what() << std::endl;
+            }
+        }
+
+        for (auto & [k, c] : clients_)
+            c->stop();
+        clients_ = std::move(next);
+    }
 };
 
 }
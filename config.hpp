@@ -0,0 +1,109 @@
+#ifndef CONFIG_HPP_
+#define CONFIG_HPP_
+
+#pragma once
+
+#include <charconv>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+#include "admission.hpp"
+
+namespace pika::config
+{
+
+/*
+ # server side
+ srv = :7000
+ srv = :7001
+ routed = :443                     # shared by tunnels bound to route:<hostname>
+ max-bridges = 4096
+ max-tunnel-bridges = 256
+ accept-rate = 500
+ memory-budget = 268435456
+
+ # client side
+ connect = example.com:7000
+ tunnel  = :8000 localhost:8080
+ tunnel  = :8022 localhost:22 16     # at most 16 concurrent bridges
+ tunnel  = route:app.example.com localhost:8443
+*/
+
+struct tunnel
+{
+    std::string bind;
+    std::string export_host;
+    std::uint32_t max_bridges {0}; // 0 leaves the server default
+};
+
+struct settings
+{
+    std::vector<std::string> srv;
+    std::string routed;
+    admission::limits limits;
+    std::string connect;
+    std::vector<tunnel> tunnels;
+
+    bool client_side() const { return not tunnels.empty(); }
+};
+
+inline
+settings load(std::string const & path)
+{
+    namespace po = boost::program_options;
+    settings s;
+    std::vector<std::string> tunnel_lines;
+
+    po::options_description desc{"Config"};
+    desc.add_options()
+        ("srv",                po::value<std::vector<std::string>>(&s.srv)->composing())
+        ("routed",             po::value<std::string>(&s.routed))
+        ("max-bridges",        po::value<std::size_t>(&s.limits.max_bridges))
+        ("max-tunnel-bridges", po::value<std::size_t>(&s.limits.max_tunnel_bridges))
+        ("accept-rate",        po::value<double>(&s.limits.accept_rate))
+        ("memory-budget",      po::value<std::size_t>(&s.limits.memory_budget))
+        ("connect",            po::value<std::string>(&s.connect))
+        ("tunnel",             po::value<std::vector<std::string>>(&tunnel_lines)->composing());
+
+    std::ifstream file{path};
+    if (not file)
+        throw std::runtime_error("cannot open config file " + path);
+
+    po::variables_map vm;
+    po::store(po::parse_config_file(file, desc), vm);
+    po::notify(vm);
+
+    std::set<std::string> binds;
+    for (std::string const & line : tunnel_lines)
+    {
+        std::istringstream fields{line};
+        tunnel t;
+        std::string max_bridges, extra;
+        if (not (fields >> t.bind >> t.export_host) || fields >> max_bridges >> extra)
+            throw std::runtime_error("config: tunnel needs '<bind> <export> [max-bridges]', got: " + line);
+        if (not max_bridges.empty())
+        {
+            char const * const end = max_bridges.data() + max_bridges.size();
+            auto const [parsed, ec] = std::from_chars(max_bridges.data(), end, t.max_bridges);
+            if (ec != std::errc{} || parsed != end)
+                throw std::runtime_error("config: tunnel max-bridges must be a number, got: " + line);
+        }
+        // one client per bind, a second one could never be stopped
+        if (not binds.insert(t.bind).second)
+            throw std::runtime_error("config: tunnel " + t.bind + " is declared twice");
+        s.tunnels.push_back(t);
+    }
+
+    if (s.client_side() && s.connect.empty())
+        throw std::runtime_error("config: tunnel requires connect");
+    if (not s.client_side() && s.srv.empty())
+        s.srv.push_back(":7000");
+    return s;
+}
+
+}// namespace pika::config
+
+#endif // CONFIG_HPP_
@@ -1,43 +1,544 @@
 #ifndef CONTROLLER_HPP_
 #define CONTROLLER_HPP_
 
+#include <algorithm>
 #include <unordered_map>
 #include <memory>
+#include <optional>
+#include <sstream>
+#include <map>
+#include <set>
 #include "basic.hpp"
+#include "admission.hpp"
+#include "bridge.hpp"
+#include "config.hpp"
+#include "keepalive.hpp"
+#include "route.hpp"
+#include "tls.hpp"
+#include "trace.hpp"
+#include "upgrade.hpp"
 
 namespace pika
 {
 
 class controller
 {
-    lib::tcp::endpoint listen_ep_;
-    std::unordered_map<std::uint32_t, lib::tcp::socket> clients;
+    struct tunnel;
+
+    struct pending_connection
+    {
+        lib::tcp::socket  socket;
+        admission::ticket ticket;
+        std::shared_ptr<trace::span> span;
+        tunnel const *    owner;  // dropped along with its tunnel
+        std::chrono::steady_clock::time_point expiry; // dropped if the dial-back is not there by then
+        bool              claimed {false}; // its dial-back arrived, start_bridge takes it
+    };
+
+    // Shared by the accept loop, the keep-alive writer and the control frame reader.
+    // A routed tunnel has a hostname instead of an open acceptor of its own.
+    struct tunnel
+    {
+        tls::stream        remote;
+        lib::tcp::acceptor acceptor;
+        admission::gate    gate;
+        std::string        name;
+        keepalive::probe   probe;
+        bool               reading {false}; // a frame is partly read
+        bool               moving  {false}; // being handed to the new process, not read meanwhile
+
+        tunnel(tls::stream && r, lib::tcp::acceptor && a, admission & admit, keepalive::settings const & k):
+            remote{std::move(r)},
+            acceptor{std::move(a)},
+            gate{admit},
+            probe{k} {}
+
+        std::string label() const
+        {
+            if (not name.empty())
+                return std::string{route::prefix} + name;
+            boost::system::error_code ec;
+            std::ostringstream stream;
+            stream << acceptor.local_endpoint(ec);
+            return stream.str();
+        }
+    };
+
+    // keys view the name owned by their tunnel
+    using route_table = std::unordered_map<std::string_view, std::shared_ptr<tunnel>,
+                                           route::host_hash, route::host_equal>;
+
+    using tunnel_bridge = basic_bridge<tls::stream, lib::tcp::socket>;
+
+    boost::asio::io_context &io_;
+    lib::generic::endpoint listen_ep_;
+    std::map<lib::generic::endpoint, std::shared_ptr<lib::generic_acceptor>> listeners_;
+    admission & admission_;
+    std::shared_ptr<tls::context> tls_;
+    std::shared_ptr<trace::collector> tracer_;
+    keepalive::settings keepalive_;
+    std::unordered_map<std::uint32_t, pending_connection> clients;
+    std::shared_ptr<lib::tcp::acceptor> routed_;
+    route_table routes_;
+    std::set<std::shared_ptr<tunnel>> tunnels_;
+    std::map<lib::tcp::endpoint, lib::tcp::acceptor> parked_; // handed over, waiting for their client to bind again
+    bool handed_off_ {false};
+    bool handing_off_ {false};      // until the new process confirms
+    boost::asio::steady_timer resume_; // wakes whoever sat out the hand off
 public:
-    controller(std::string_view listen_host, boost::asio::io_context &io_context):
-        listen_ep_{util::make_connectable(listen_host, io_context)} {}
+    controller(std::string_view listen_host, boost::asio::io_context &io_context, admission &admit,
+               std::shared_ptr<tls::context> tls = nullptr,
+               std::shared_ptr<trace::collector> tracer = nullptr,
+               keepalive::settings const & keepalive = {}):
+        io_{io_context},
+        listen_ep_{util::make_endpoint(listen_host, io_context)},
+        admission_{admit},
+        tls_{std::move(tls)},
+        tracer_{std::move(tracer)},
+        keepalive_{keepalive},
+        resume_{io_context} {}
 
     lib::awaitable<void> run()
     {
+        try
+        {
+            open_listener(listen_ep_);
+        }
+        catch (std::exception const & e)
+        {
+            std::cerr << "controller::run " << util::to_string(listen_ep_) << ": " << e.what() << std::endl;
+        }
+        co_await expire_pending();
+    }
+
+    // Public connections still waiting for the client to dial back
+    std::size_t pending() const { return clients.size(); }
+
+    // One line per connected client: its tunnel, round trip and waiting connections
+    void report(std::ostream & os) const
+    {
+        for (std::shared_ptr<tunnel> const & t : tunnels_)
+        {
+            os << "tunnel " << t->label() << ": ";
+            t->probe.report(os);
+            os << ", pending " << std::count_if(clients.begin(), clients.end(),
+                                                [&t](auto const & c) { return c.second.owner == t.get(); })
+               << "\n";
+        }
+    }
+
+    // Opens, moves or closes (empty host) the public listener shared by
+    // route:<hostname> tunnels. Registered routes survive a move.
+    void set_routed(std::string_view routed_host)
+    {
+        if (handed_off_ || handing_off_)
+            return;
+        std::optional<lib::tcp::endpoint> ep;
+        if (not routed_host.empty())
+            ep = util::make_connectable(routed_host, io_);
+
+        boost::system::error_code ec;
+        if (routed_ && ep && routed_->local_endpoint(ec) == *ep)
+            return;
+        if (routed_)
+        {
+            std::cout << "stop routing on " << routed_->local_endpoint(ec) << "\n";
+            routed_->close(ec);
+            routed_.reset();
+        }
+        if (not ep)
+            return;
+
+        routed_ = std::make_shared<lib::tcp::acceptor>(io_, *ep);
+        std::cout << "routing by hostname on " << *ep << "\n";
+        lib::co_spawn(io_,
+                      [acceptor = routed_, this]() mutable {
+                          return accept_routed(std::move(acceptor));
+                      }, lib::detached);
+    }
+
+    // Applies a reloaded config: opens new listeners, closes dropped ones
+    // and swaps the limits. Tunnels, their bridges and control connections stay.
+    void reconfigure(config::settings const & cfg)
+    {
+        if (handed_off_ || handing_off_)
+            return;
+        admission_.set_limits(cfg.limits);
+        try
+        {
+            set_routed(cfg.routed);
+        }
+        catch (std::exception const & e)
+        {
+            std::cerr << "controller::reconfigure routed " << cfg.routed << ": " << e.what() << std::endl;
+        }
+
+        std::set<lib::generic::endpoint> wanted;
+        for (std::string const & host : cfg.srv)
+        {
+            try
+            {
+                lib::generic::endpoint ep = util::make_endpoint(host, io_);
+                wanted.insert(ep);
+                open_listener(ep);
+            }
+            catch (std::exception const & e)
+            {
+                std::cerr << "controller::reconfigure " << host << ": " << e.what() << std::endl;
+            }
+        }
+
+        for (auto it = listeners_.begin(); it != listeners_.end();)
+        {
+            if (wanted.count(it->first))
+            {
+                ++it;
+                continue;
+            }
+            boost::system::error_code ec;
+            it->second->close(ec);
+            std::cout << "stop listening on " << util::to_string(it->first) << "\n";
+            it = listeners_.erase(it);
+        }
+    }
+
+    // Upgrade: passes the listeners, the public listeners of tunnels and the
+    // waiting public connections to the new process; with `controls` also the
+    // control connections that hold no userspace TLS state and no partly read
+    // or written frame. Nothing changes until the new process is up; from then
+    // until it confirms, bridges and the other control connections go on while
+    // the acceptors and the moved control connections sit still. Once it took
+    // them over we stop accepting and close every control connection, clients
+    // whose connection did not move reconnect to the new process. Bridges keep going.
+    lib::awaitable<void> hand_off(upgrade::child const & c, bool controls)
+    {
+        using namespace std::chrono_literals;
+        auto token = co_await lib::this_coro::token();
+        co_await upgrade::started(c, upgrade::take_over_timeout);
+
+        // new connections wait in the listen queues, whichever process takes them
+        handing_off_ = true;
+        resume_.expires_at(std::chrono::steady_clock::time_point::max());
+        std::vector<std::shared_ptr<tunnel>> moving;
+        for (std::shared_ptr<tunnel> const & t : tunnels_)
+            if (controls && t->remote.movable() && not t->reading)
+            {
+                t->moving = true;
+                t->remote.hold();
+                moving.push_back(t);
+            }
+        boost::system::error_code ec;
+        for (auto & [ep, acceptor] : listeners_)
+            acceptor->cancel(ec);
+        if (routed_)
+            routed_->cancel(ec);
+        for (std::shared_ptr<tunnel> const & t : tunnels_)
+            t->acceptor.cancel(ec);
+
+        // frames already on their way go out first, a connection that cannot
+        // get rid of them within a second stays here
+        auto busy = [](std::shared_ptr<tunnel> const & t) { return not t->remote.idle(); };
+        boost::asio::steady_timer timer{io_};
+        for (int i = 0; i < 100 && std::any_of(moving.begin(), moving.end(), busy); i++)
+        {
+            timer.expires_after(10ms);
+            co_await timer.async_wait(token);
+        }
+        for (std::shared_ptr<tunnel> const & t : moving)
+            if (busy(t))
+            {
+                t->moving = false;
+                t->remote.release();
+            }
+        moving.erase(std::remove_if(moving.begin(), moving.end(), busy), moving.end());
+
+        using upgrade::item;
+        std::vector<item> items;
+        for (auto & [ep, acceptor] : listeners_)
+            items.push_back({item::kind::listener, 0, 0, static_cast<std::uint32_t>(ep.protocol().protocol()),
+                             std::string{reinterpret_cast<char const *>(ep.data()), ep.size()}, acceptor->native_handle()});
+        if (routed_)
+            items.push_back({item::kind::routed, 0, 0, 0, {}, routed_->native_handle()});
+
+        std::map<tunnel const *, std::uint32_t> moved;
+        std::uint32_t index = 0;
+        for (std::shared_ptr<tunnel> const & t : tunnels_)
+        {
+            ++index;
+            if (t->acceptor.is_open())
+                items.push_back({item::kind::acceptor, 0, index, 0, {}, t->acceptor.native_handle()});
+            if (t->moving)
+            {
+                items.push_back({item::kind::control, std::uint8_t{t->remote.offloaded()}, index,
+                                 static_cast<std::uint32_t>(t->gate.cap()), t->name,
+                                 t->remote.lowest_layer().native_handle()});
+                moved.emplace(t.get(), index);
+            }
+        }
+        for (auto & [id, pending] : clients)
+        {
+            if (pending.claimed) // being bridged here
+                continue;
+            auto it = moved.find(pending.owner);
+            items.push_back({item::kind::pending, 0, it == moved.end()? 0: it->second, id, {}, pending.socket.native_handle()});
+        }
+
+        try
+        {
+            // our own copies, a socket closed meanwhile must not leave its number to another one
+            for (item & it : items)
+                it.fd = ::fcntl(it.fd, F_DUPFD_CLOEXEC, 0);
+            BOOST_SCOPE_EXIT (&items) {
+                for (upgrade::item const & it : items)
+                    if (it.fd >= 0)
+                        ::close(it.fd);
+            } BOOST_SCOPE_EXIT_END;
+            if (std::any_of(items.begin(), items.end(), [](item const & it) { return it.fd < 0; }))
+                upgrade::fail("upgrade dup");
+
+            co_await upgrade::hand_over(c, items, upgrade::take_over_timeout);
+        }
+        catch (std::exception const &)
+        {
+            for (std::shared_ptr<tunnel> const & t : moving)
+            {
+                t->moving = false;
+                t->remote.release();
+            }
+            handing_off_ = false;
+            resume_.cancel(ec);
+            throw;
+        }
+
+        // the sockets live on in the new process, this only drops our descriptors
+        handed_off_  = true;
+        handing_off_ = false;
+        for (auto & [ep, acceptor] : listeners_)
+            acceptor->close(ec);
+        listeners_.clear();
+        if (routed_)
+            routed_->close(ec);
+        routed_.reset();
+        for (std::shared_ptr<tunnel> const & t : moving)
+            t->remote.release(boost::asio::error::bad_descriptor);
+        for (std::shared_ptr<tunnel> const & t : tunnels_)
+        {
+            t->acceptor.close(ec);
+            t->remote.lowest_layer().close(ec);
+        }
+        clients.clear();
+        resume_.cancel(ec);
+        std::cout << "handed " << items.size() << " sockets over, " << moved.size() << " of "
+                  << tunnels_.size() << " tunnels with their control connection\n";
+    }
+
+    // The other end of hand_off, before run()
+    void adopt(std::vector<upgrade::item> const & items)
+    {
+        using upgrade::item;
+        std::map<std::uint32_t, lib::tcp::acceptor> acceptors;
+        std::map<std::uint32_t, std::shared_ptr<tunnel>> resumed;
+        admission::gate orphans {admission_}; // waiting connections whose tunnel did not move
+        for (item const & it : items)
+        {
+            switch (it.what)
+            {
+                case item::kind::listener:
+                {
+                    lib::generic::endpoint const ep{it.data.data(), it.data.size(), static_cast<int>(it.value)};
+                    auto acceptor = std::make_shared<lib::generic_acceptor>(io_, ep.protocol(), it.fd);
+                    listeners_.emplace(ep, acceptor);
+                    std::cout << "took over listening on " << util::to_string(ep) << "\n";
+                    lib::co_spawn(io_,
+                                  [acceptor, this]() mutable {
+                                      return accept_control(std::move(acceptor));
+                                  }, lib::detached);
+                    break;
+                }
+                case item::kind::routed:
+                {
+                    routed_ = std::make_shared<lib::tcp::acceptor>(io_, upgrade::tcp_protocol(it.fd), it.fd);
+                    std::cout << "took over routing on " << routed_->local_endpoint() << "\n";
+                    lib::co_spawn(io_,
+                                  [acceptor = routed_, this]() mutable {
+                                      return accept_routed(std::move(acceptor));
+                                  }, lib::detached);
+                    break;
+                }
+                case item::kind::acceptor:
+                    acceptors.emplace(it.tunnel, lib::tcp::acceptor{io_, upgrade::tcp_protocol(it.fd), it.fd});
+                    break;
+                case item::kind::control:
+                {
+                    tls::stream remote{lib::generic::socket{io_, upgrade::generic_protocol(it.fd), it.fd}, it.flags != 0};
+                    lib::tcp::acceptor acceptor{io_};
+                    if (auto a = acceptors.find(it.tunnel); a != acceptors.end())
+                    {
+                        acceptor = std::move(a->second);
+                        acceptors.erase(a);
+                    }
+                    auto t  = std::make_shared<tunnel>(std::move(remote), std::move(acceptor), admission_, keepalive_);
+                    t->name = it.data;
+                    t->gate.cap(it.value);
+                    resumed.emplace(it.tunnel, t);
+                    if (t->name.empty())
+                        lib::co_spawn(io_, [t, this]() mutable { return serve_tunnel(std::move(t)); }, lib::detached);
+                    else
+                    {
+                        routes_.emplace(t->name, t);
+                        lib::co_spawn(io_, [t, this]() mutable { return serve_route(std::move(t)); }, lib::detached);
+                    }
+                    break;
+                }
+                case item::kind::pending:
+                {
+                    lib::tcp::socket socket{io_, upgrade::tcp_protocol(it.fd), it.fd};
+                    auto const owner = resumed.find(it.tunnel);
+                    tunnel * const t = owner == resumed.end()? nullptr: owner->second.get();
+                    // admitted again, expire_pending closes it if the dial-back never comes
+                    admission::ticket ticket = (t? t->gate: orphans).admit(def::socket_cost);
+                    if (not ticket)
+                        break;
+                    clients.insert({it.value, pending_connection{std::move(socket), std::move(ticket), nullptr, t,
+                                                                 std::chrono::steady_clock::now() + def::dial_back_timeout}});
+                    break;
+                }
+                case item::kind::done:
+                    break;
+            }
+        }
+
+        for (auto & [index, acceptor] : acceptors)
+        {
+            boost::system::error_code ec;
+            lib::tcp::endpoint const ep = acceptor.local_endpoint(ec);
+            parked_.emplace(ep, std::move(acceptor));
+        }
+        if (not parked_.empty())
+            lib::co_spawn(io_, [this] { return expire_parked(); }, lib::detached);
+    }
+
+private:
+    // Suspends while a hand off is in flight; false once it went through
+    lib::awaitable<bool> sit_out()
+    {
+        auto token = co_await lib::this_coro::token();
+        while (handing_off_)
+        {
+            try
+            {
+                co_await resume_.async_wait(token);
+            }
+            catch (boost::system::system_error const &) {} // cancelled when it is decided
+        }
+        co_return not handed_off_;
+    }
+
+    // async_accept that sits out a hand off: the acceptors are cancelled
+    // meanwhile, and keep accepting if it fails
+    template<typename Acceptor>
+    lib::awaitable<typename Acceptor::protocol_type::socket> accept(Acceptor & acceptor)
+    {
+        auto token = co_await lib::this_coro::token();
+        for (;;)
+        {
+            bool paused = false;
+            try
+            {
+                co_return co_await acceptor.async_accept(token);
+            }
+            catch (boost::system::system_error const & e)
+            {
+                if (e.code() != boost::asio::error::operation_aborted || not handing_off_)
+                    throw;
+                paused = true;
+            }
+            if (paused && not co_await sit_out())
+                throw boost::system::system_error{boost::asio::error::operation_aborted};
+        }
+    }
+
+    void open_listener(lib::generic::endpoint const & ep)
+    {
+        if (listeners_.count(ep))
+            return;
+
+        auto acceptor = std::make_shared<lib::generic_acceptor>(util::make_listener(io_, ep));
+        listeners_.emplace(ep, acceptor);
+        std::cout << "start listining on " << util::to_string(ep) << "\n";
+        lib::co_spawn(io_,
+                      [acceptor, this]() mutable {
+                          return accept_control(std::move(acceptor));
+                      }, lib::detached);
+    }
+
+    lib::awaitable<void> accept_control(std::shared_ptr<lib::generic_acceptor> acceptor)
+    {
+        using namespace std::chrono_literals;
         auto executor = co_await lib::this_coro::executor();
         auto token    = co_await lib::this_coro::token();
 
-        lib::tcp::acceptor acceptor {executor.context(), listen_ep_};
-        std::cout << "start listining on " << listen_ep_ << "\n";
-        for (;;)
+        admission::gate gate {admission_};
+        bool back_off = false; // no co_await inside a handler
+        while (acceptor->is_open())
         {
-            lib::tcp::socket socket = co_await acceptor.async_accept(token);
-            lib::co_spawn(executor,
-                          [socket = std::move(socket), this]() mutable {
-                              return init_session(std::move(socket));
-                          }, lib::detached);
+            co_await gate.wait();
+            try
+            {
+                lib::generic::socket socket = co_await accept(*acceptor);
+                // held until the first frame is read, so a flood of handshakes is capped like bridges
+                admission::ticket ticket = gate.admit(tls_? def::tls_cost: def::socket_cost);
+                if (not ticket)
+                {
+                    boost::system::error_code ec;
+                    socket.close(ec);
+                    continue;
+                }
+                lib::co_spawn(executor,
+                              [socket = std::move(socket), ticket = std::move(ticket), this]() mutable {
+                                  return init_session(std::move(socket), std::move(ticket));
+                              }, lib::detached);
+            }
+            catch (boost::system::system_error const & e)
+            {
+                if (e.code() == boost::asio::error::operation_aborted)
+                    break;
+                // e.g. out of fds: back off instead of losing the listener
+                std::cerr << "controller::accept_control exception: " << e.what() << std::endl;
+                back_off = true;
+            }
+            if (std::exchange(back_off, false))
+            {
+                boost::asio::steady_timer t{executor.context(), 100ms};
+                co_await t.async_wait(token);
+            }
         }
     }
-private:
-    lib::awaitable<void> init_session(lib::tcp::socket && socket)
+
+    lib::awaitable<void> init_session(lib::generic::socket && raw_socket, admission::ticket ticket)
     {
         auto executor = co_await lib::this_coro::executor();
         auto token    = co_await lib::this_coro::token();
 
+        tls::stream socket{std::move(raw_socket)};
+        // a peer that stalls the handshake or its first frame must not keep the slot
+        util::deadline const deadline{executor.context(), def::handshake_timeout, [&socket] {
+            boost::system::error_code ec;
+            socket.lowest_layer().close(ec);
+        }};
+        if (tls_)
+        {
+            try
+            {
+                co_await socket.handshake(*tls_, boost::asio::ssl::stream_base::server);
+            }
+            catch (std::exception const & e)
+            {
+                std::cerr << "controller::init_session handshake failed: " << e.what() << std::endl;
+                co_return;
+            }
+        }
+
         std::array<std::uint8_t, 8> buf;
         std::size_t length = co_await boost::asio::async_read(socket, boost::asio::buffer(buf), token);
         assert(length == 8);
@@ -59,7 +560,9 @@ private:
                 lib::co_spawn(executor,
                               [socket = std::move(socket), ipv4, port, this]() mutable {
                                   boost::asio::socket_base::keep_alive opt{true};
-                                  socket.set_option(opt);
+                                  boost::system::error_code ec; // meaningless on unix sockets
+                                  socket.lowest_layer().set_option(opt, ec);
+                                  socket.lowest_layer().set_option(lib::tcp::no_delay{true}, ec); // pongs must not wait for an ACK
                                   return start_reverse_tunnel(std::move(socket), ipv4, port);
                               }, lib::detached);
                 break;
@@ -69,96 +572,490 @@ private:
                 std::uint32_t id = 0;
                 std::memcpy(&id, &buf[2], sizeof id);
                 boost::endian::big_to_native_inplace(id);
+                if (buf.at(1) != 0x00) // the client could not reach its export
+                {
+                    clients.erase(id);
+                    break;
+                }
+                if (auto it = clients.find(id); it != clients.end())
+                    it->second.claimed = true;
                 lib::co_spawn(executor,
                               [socket = std::move(socket), id, this]() mutable {
                                   return start_bridge(std::move(socket), id);
                               }, lib::detached);
                 break;
             }
+            case 0x06: // Request a route, the hostname follows
+            {
+                std::size_t const name_length = buf[2] << 8 | buf[3];
+                if (name_length == 0 || name_length > route::max_name)
+                {
+                    std::array<std::uint8_t, 8> response{0x06 /* ROUTE */, 0x01 /* FAILED */};
+                    co_await socket.write_frame(response);
+                    break;
+                }
+                std::string name(route::padded(name_length), '\0');
+                std::ignore = co_await boost::asio::async_read(socket, boost::asio::buffer(name), token);
+                name.resize(name_length);
+
+                lib::co_spawn(executor,
+                              [socket = std::move(socket), name = std::move(name), this]() mutable {
+                                  boost::asio::socket_base::keep_alive opt{true};
+                                  boost::system::error_code ec;
+                                  socket.lowest_layer().set_option(opt, ec);
+                                  socket.lowest_layer().set_option(lib::tcp::no_delay{true}, ec);
+                                  return start_routed_tunnel(std::move(socket), std::move(name));
+                              }, lib::detached);
+                break;
+            }
             default:
             {
                 // response failed
                 std::array<std::uint8_t, 8> response{0x00 /* CONNECT */, 0x01 /* FAILED */};
-                std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(response), token);
+                co_await socket.write_frame(response);
                 break;
             }
         }
     }
 
-    lib::awaitable<void> start_reverse_tunnel(lib::tcp::socket && remote_socket,
+    lib::awaitable<void> start_reverse_tunnel(tls::stream && remote_socket,
                                               std::uint32_t ip, std::uint16_t port)
     {
+        lib::tcp::endpoint ep{boost::asio::ip::address_v4{ip}, port};
+        std::shared_ptr<tunnel> t;
+        try
+        {
+            t = std::make_shared<tunnel>(std::move(remote_socket), claim_acceptor(ep), admission_, keepalive_);
+        }
+        catch (std::exception const & e)
+        {
+            std::cerr << "controller::start_reverse_tunnel exception: " << e.what() << std::endl;
+        }
+        if (not t)
+        {
+            std::array<std::uint8_t, 8> response{0x02 /* CONNECT */, 0x01 /* FAILED */};
+            co_await remote_socket.write_frame(response);
+            co_return;
+        }
+        co_await serve_tunnel(std::move(t));
+    }
+
+    // A public listener handed over by an upgrade goes back to the client
+    // binding its endpoint, with the connections that queued up meanwhile
+    lib::tcp::acceptor claim_acceptor(lib::tcp::endpoint const & ep)
+    {
+        auto it = parked_.find(ep);
+        if (it == parked_.end())
+            return lib::tcp::acceptor{io_, ep};
+        lib::tcp::acceptor acceptor = std::move(it->second);
+        parked_.erase(it);
+        return acceptor;
+    }
+
+    lib::awaitable<void> expire_parked()
+    {
+        auto executor = co_await lib::this_coro::executor();
+        auto token    = co_await lib::this_coro::token();
+        boost::asio::steady_timer timer{executor.context(), upgrade::claim_window};
+        co_await timer.async_wait(token);
+        for (auto & [ep, acceptor] : parked_)
+            std::cout << "no client bound " << ep << " again, closing it\n";
+        parked_.clear();
+    }
+
+    lib::awaitable<void> serve_tunnel(std::shared_ptr<tunnel> t)
+    {
+        using namespace std::chrono_literals;
         auto executor = co_await lib::this_coro::executor();
         auto token    = co_await lib::this_coro::token();
 
+        tls::stream & remote = t->remote;
+        std::string const label = t->label();
+        bool closed_by_client = false;
+        tunnels_.insert(t);
         try
         {
-            lib::tcp::endpoint ep{boost::asio::ip::address_v4{ip}, port};
-            lib::tcp::acceptor acceptor(executor.context(), ep);
-            std::cout << "reverse tunnel start listening on " << ep << "\n";
-            BOOST_SCOPE_EXIT (&ep) {
-                std::cout << "reverse tunnel closed listening on " << ep << "\n";
+            std::cout << "reverse tunnel start listening on " << label << " (" << remote.mode() << ")\n";
+            BOOST_SCOPE_EXIT (&label) {
+                std::cout << "reverse tunnel closed listening on " << label << "\n";
             } BOOST_SCOPE_EXIT_END;
 
             lib::co_spawn(executor,
-                          [&remote_socket, &acceptor]() mutable {
-                              return monitor_socket(remote_socket, acceptor);
+                          [t]() mutable {
+                              return monitor_socket(std::move(t));
+                          }, lib::detached);
+            lib::co_spawn(executor,
+                          [t, this]() mutable {
+                              return read_control(std::move(t));
                           }, lib::detached);
 
+            bool back_off = false; // no co_await inside a handler
             for (;;)
             {
-                lib::tcp::socket socket = co_await acceptor.async_accept(token);
-                std::uint32_t address   = util::hash(socket.remote_endpoint());
-                clients.insert({address, std::move(socket)});
+                co_await t->gate.wait();
+                lib::tcp::socket socket{executor.context()};
+                try
+                {
+                    socket = co_await accept(t->acceptor);
+                }
+                catch (boost::system::system_error const & e)
+                {
+                    if (e.code() == boost::asio::error::operation_aborted)
+                        throw;
+                    if (not t->acceptor.is_open()) // closed by read_control meanwhile
+                        throw boost::system::system_error{boost::asio::error::operation_aborted};
+                    // e.g. out of fds: back off instead of losing the tunnel
+                    std::cerr << "controller::serve_tunnel accept exception: " << e.what() << std::endl;
+                    back_off = true;
+                }
+                if (std::exchange(back_off, false))
+                {
+                    boost::asio::steady_timer timer{executor.context(), 100ms};
+                    co_await timer.async_wait(token);
+                    continue;
+                }
+                admission::ticket ticket = t->gate.admit(def::socket_cost);
+                if (not ticket)
+                {
+                    boost::system::error_code ec;
+                    socket.close(ec);
+                    continue;
+                }
+                co_await offer(*t, std::move(socket), std::move(ticket));
+            }
+        }
+        catch (boost::system::system_error const & e)
+        {
+            closed_by_client = e.code() == boost::asio::error::operation_aborted;
+            if (not closed_by_client)
+                std::cerr << "controller::serve_tunnel exception: " << e.what() << std::endl;
+        }
+        catch (std::exception const & e)
+        {
+            std::cerr << "controller::serve_tunnel exception: " << e.what() << std::endl;
+        }
+
+        if (not closed_by_client)
+        {
+            try
+            {
+                std::array<std::uint8_t, 8> response{0x02 /* CONNECT */, 0x01 /* FAILED */};
+                co_await remote.write_frame(response);
+            }
+            catch (std::exception const &) {}
+        }
+        boost::system::error_code ec;
+        t->acceptor.close(ec);
+        remote.lowest_layer().close(ec);
+        drop(t);
+    }
 
-                std::array<std::uint8_t, 8> response{0x02};
-                boost::endian::native_to_big_inplace(address);
-                std::memcpy(&response[2], &address, sizeof address);
+    // A route:<hostname> registration: the tunnel lives in routes_ until its
+    // client goes away, accept_routed hands it the connections for its name.
+    lib::awaitable<void> start_routed_tunnel(tls::stream && remote_socket, std::string name)
+    {
+        auto executor = co_await lib::this_coro::executor();
 
-                std::ignore = co_await boost::asio::async_write(remote_socket, boost::asio::buffer(response), token);
+        auto t  = std::make_shared<tunnel>(std::move(remote_socket), lib::tcp::acceptor{executor.context()}, admission_, keepalive_);
+        t->name = std::move(name);
+        if (not routed_ || not routes_.emplace(t->name, t).second)
+        {
+            std::cerr << "controller::start_routed_tunnel " << t->label()
+                      << (routed_? " already registered": " without a routed listener") << std::endl;
+            std::array<std::uint8_t, 8> response{0x06 /* ROUTE */, 0x01 /* FAILED */};
+            try
+            {
+                co_await t->remote.write_frame(response);
             }
+            catch (std::exception const &) {}
+            co_return;
         }
-        catch (std::exception const & e)
+        co_await serve_route(std::move(t));
+    }
+
+    lib::awaitable<void> serve_route(std::shared_ptr<tunnel> t)
+    {
+        auto executor = co_await lib::this_coro::executor();
+
+        std::cout << "reverse tunnel " << t->label() << " registered (" << t->remote.mode() << ")\n";
+        tunnels_.insert(t);
+        lib::co_spawn(executor,
+                      [t]() mutable {
+                          return monitor_socket(std::move(t));
+                      }, lib::detached);
+        co_await read_control(t);
+
+        routes_.erase(t->name);
+        std::cout << "reverse tunnel " << t->label() << " removed\n";
+        boost::system::error_code ec;
+        t->remote.lowest_layer().close(ec);
+        drop(t);
+    }
+
+    // A dial-back that never arrives must not hold its public connection and ticket
+    lib::awaitable<void> expire_pending()
+    {
+        using namespace std::chrono_literals;
+        auto executor = co_await lib::this_coro::executor();
+        auto token    = co_await lib::this_coro::token();
+
+        boost::asio::steady_timer timer{executor.context()};
+        while (not handed_off_)
         {
-            std::array<std::uint8_t, 8> response{0x02 /* CONNECT */, 0x01 /* FAILED */};
-            std::ignore = co_await boost::asio::async_write(remote_socket, boost::asio::buffer(response), token);
-            std::cerr << "controller::start_reverse_tunnel exception: " << e.what() << std::endl;
+            timer.expires_after(1s);
+            co_await timer.async_wait(token);
+            auto const now = std::chrono::steady_clock::now();
+            std::size_t expired = 0;
+            for (auto it = clients.begin(); it != clients.end();)
+            {
+                if (it->second.expiry > now)
+                    ++it;
+                else
+                {
+                    it = clients.erase(it);
+                    expired++;
+                }
+            }
+            if (expired)
+                std::cerr << "controller::expire_pending " << expired << " connections got no dial-back" << std::endl;
         }
     }
 
-    static
-    lib::awaitable<void> monitor_socket(lib::tcp::socket & remote, lib::tcp::acceptor & acceptor)
+    // Forgets an ended tunnel and the public connections still waiting for its client
+    void drop(std::shared_ptr<tunnel> const & t)
+    {
+        tunnels_.erase(t);
+        for (auto it = clients.begin(); it != clients.end();)
+            it = it->second.owner == t.get()? clients.erase(it): std::next(it);
+    }
+
+    lib::awaitable<void> accept_routed(std::shared_ptr<lib::tcp::acceptor> acceptor)
+    {
+        using namespace std::chrono_literals;
+        auto executor = co_await lib::this_coro::executor();
+        auto token    = co_await lib::this_coro::token();
+
+        admission::gate gate {admission_};
+        bool back_off = false; // no co_await inside a handler
+        while (acceptor->is_open())
+        {
+            co_await gate.wait();
+            try
+            {
+                lib::tcp::socket socket = co_await accept(*acceptor);
+                // held while the header is sniffed, so stalled clients are capped like bridges
+                admission::ticket ticket = gate.admit(route::max_peek + def::socket_cost);
+                if (not ticket)
+                {
+                    boost::system::error_code ec;
+                    socket.close(ec);
+                    continue;
+                }
+                lib::co_spawn(executor,
+                              [socket = std::move(socket), ticket = std::move(ticket), this]() mutable {
+                                  return route_connection(std::move(socket), std::move(ticket));
+                              }, lib::detached);
+            }
+            catch (boost::system::system_error const & e)
+            {
+                if (e.code() == boost::asio::error::operation_aborted)
+                    break;
+                std::cerr << "controller::accept_routed exception: " << e.what() << std::endl;
+                back_off = true;
+            }
+            if (std::exchange(back_off, false))
+            {
+                boost::asio::steady_timer t{executor.context(), 100ms};
+                co_await t.async_wait(token);
+            }
+        }
+    }
+
+    // Peeks at the first flight of a routed connection until the SNI or Host
+    // header shows up. Nothing is consumed: the client's own bytes reach the
+    // exported service unchanged once the bridge starts.
+    lib::awaitable<void> route_connection(lib::tcp::socket raw_socket, admission::ticket sniff_ticket)
     {
-        std::array<std::uint8_t, 8> keep_alive{};
+        using namespace std::chrono_literals;
         auto executor = co_await lib::this_coro::executor();
         auto token    = co_await lib::this_coro::token();
-        using namespace std::literals;
 
+        try
+        {
+            // a client that stalls mid-header must not hold the connection
+            auto socket = std::make_shared<lib::tcp::socket>(std::move(raw_socket));
+            boost::asio::steady_timer deadline{executor.context(), 5s};
+            deadline.async_wait([weak = std::weak_ptr<lib::tcp::socket>{socket}](boost::system::error_code const & ec) {
+                boost::system::error_code ignored;
+                if (auto s = weak.lock(); s && not ec)
+                    s->close(ignored);
+            });
+
+            std::array<char, route::max_peek> head;
+            std::size_t peeked = co_await socket->async_receive(boost::asio::buffer(head),
+                                                                lib::tcp::socket::message_peek, token);
+            route::sniffed s = route::sniff({head.data(), peeked});
+            while (s.v == route::verdict::incomplete && peeked < head.size())
+            {
+                // the reactor is edge-triggered and a wait is not speculative: bytes
+                // that came in since the last peek raise no edge, peek them right away
+                if (socket->available() <= peeked)
+                {
+                    // readable again only once more than what was peeked has arrived
+                    socket->set_option(boost::asio::socket_base::receive_low_watermark(static_cast<int>(peeked + 1)));
+                    co_await socket->async_wait(lib::tcp::socket::wait_read, token);
+                }
+                std::size_t const more = co_await socket->async_receive(boost::asio::buffer(head),
+                                                                        lib::tcp::socket::message_peek, token);
+                if (more <= peeked) // closed before the header was complete
+                    break;
+                peeked = more;
+                s = route::sniff({head.data(), peeked});
+            }
+            deadline.cancel();
+            socket->set_option(boost::asio::socket_base::receive_low_watermark(1));
+
+            if (s.v != route::verdict::found)
+                co_return;
+            auto it = routes_.find(s.host);
+            if (it == routes_.end())
+            {
+                std::cerr << "controller::route_connection no tunnel for " << s.host << std::endl;
+                co_return;
+            }
+
+            std::shared_ptr<tunnel> t = it->second;
+            admission::ticket ticket = t->gate.admit(def::socket_cost);
+            sniff_ticket.release();
+            if (not ticket)
+                co_return;
+            co_await offer(*t, std::move(*socket), std::move(ticket));
+        }
+        catch (std::exception const & e)
+        {
+            std::cerr << "controller::route_connection exception: " << e.what() << std::endl;
+        }
+    }
+
+    // Parks a public connection in clients and asks the tunnel's client to dial back for it
+    lib::awaitable<void> offer(tunnel & t, lib::tcp::socket && socket, admission::ticket && ticket)
+    {
+        // its notice could not be sent before the control connection moves
+        if (t.moving && not co_await sit_out())
+            co_return;
+        boost::system::error_code ec;
+        lib::tcp::endpoint const peer = socket.remote_endpoint(ec);
+        if (ec) // reset before it was offered, this must not take the tunnel down
+            co_return;
+
+        std::uint32_t address   = util::hash(peer);
+        std::shared_ptr<trace::span> span = tracer_? tracer_->sample(address, "controller"): nullptr;
+        if (span)
+            span->mark(trace::stage::accepted);
+        clients.insert({address, pending_connection{std::move(socket), std::move(ticket), span, &t,
+                                                    std::chrono::steady_clock::now() + def::dial_back_timeout}});
+
+        std::array<std::uint8_t, 8> response{0x02};
+        boost::endian::native_to_big_inplace(address);
+        std::memcpy(&response[2], &address, sizeof address);
+        response[6] = span? 0x01 /* TRACED */: 0x00;
+
+        co_await t.remote.write_frame(response);
+        if (span)
+            span->mark(trace::stage::notice_sent);
+    }
+
+    // Frames the client sends on its control connection after the bind request.
+    // A connection that may move to a new process is only read once a frame
+    // arrived, so a hand off never splits one between the two.
+    lib::awaitable<void> read_control(std::shared_ptr<tunnel> t)
+    {
+        auto token = co_await lib::this_coro::token();
         try
         {
             for (;;)
             {
-                boost::asio::steady_timer t{executor.context(), 10s};
-                co_await t.async_wait(token);
-                std::ignore = co_await boost::asio::async_write(remote, boost::asio::buffer(keep_alive), token);
+                if (t->remote.movable())
+                    co_await t->remote.lowest_layer().async_wait(lib::generic::socket::wait_read, token);
+                if (t->moving)
+                {
+                    if (not co_await sit_out())
+                        break;
+                    continue;
+                }
+                std::array<std::uint8_t, 8> buf;
+                t->reading = true;
+                std::ignore = co_await boost::asio::async_read(t->remote, boost::asio::buffer(buf), token);
+                t->reading = false;
+                t->probe.heard(buf);
+                switch (buf.at(0))
+                {
+                    case 0x03: // Tunnel limit
+                    {
+                        std::uint32_t max_bridges = 0;
+                        std::memcpy(&max_bridges, &buf[2], sizeof max_bridges);
+                        boost::endian::big_to_native_inplace(max_bridges);
+                        t->gate.cap(max_bridges);
+                        std::cout << "reverse tunnel " << t->label()
+                                  << " limited to " << max_bridges << " bridges\n";
+                        break;
+                    }
+                    case 0x04: // Ping
+                        co_await t->remote.write_frame(keepalive::pong(buf));
+                        break;
+                    case 0x05: // Pong
+                        t->probe.pong(buf);
+                        break;
+                    default: // do nothing
+                        break;
+                }
             }
         }
+        catch (std::exception const &) {}
+
+        // the client is gone, stop accepting for it
+        boost::system::error_code ec;
+        t->acceptor.cancel(ec);
+        t->acceptor.close(ec);
+    }
+
+    // Pings the client; one that stops answering is dropped like one that hung up
+    static
+    lib::awaitable<void> monitor_socket(std::shared_ptr<tunnel> t)
+    {
+        try
+        {
+            co_await keepalive::watch(t->remote, t->probe);
+            if (t->probe.missed())
+                std::cerr << "controller::monitor_socket " << t->label() << " missed "
+                          << t->probe.missed() << " pongs, dropping it" << std::endl;
+            else
+                std::cerr << "controller::monitor_socket " << t->label() << " went silent, dropping it" << std::endl;
+        }
         catch(boost::system::system_error const & e)
         {
-            if (e.code() != boost::asio::error::eof ||
-                e.code() != boost::asio::error::broken_pipe)
+            if (e.code() != boost::asio::error::eof &&
+                e.code() != boost::asio::error::broken_pipe &&
+                e.code() != boost::asio::error::bad_descriptor) // closed here, e.g. handed off
                 std::cerr << "controller::monitor_socket exception: " << e.what() << std::endl;
-            acceptor.cancel();
-            acceptor.close();
         }
+        boost::system::error_code ec;
+        t->acceptor.cancel(ec);
+        t->acceptor.close(ec);
+        t->remote.lowest_layer().close(ec);
     }
 
-    lib::awaitable<void> start_bridge(lib::tcp::socket && s, std::uint32_t id)
+    lib::awaitable<void> start_bridge(tls::stream && s, std::uint32_t id)
     {
         try
         {
-            lib::tcp::socket &local = clients.at(id);
-            auto b = std::make_shared<bridge>(std::move(s), std::move(local));
+            pending_connection &local = clients.at(id);
+            if (local.span)
+                local.span->mark(trace::stage::lookup);
+            auto b = std::make_shared<tunnel_bridge>(std::move(s), std::move(local.socket));
+            b->ticket_ = std::move(local.ticket);
+            b->ticket_.charge(def::bridge_cost);
+            b->span_   = std::move(local.span);
             controller * self = this;
             BOOST_SCOPE_EXIT (self, id) {
                 self->clients.erase(id);
@@ -0,0 +1,204 @@
+#ifndef KEEPALIVE_HPP_
+#define KEEPALIVE_HPP_
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include "basic.hpp"
+
+namespace pika::keepalive
+{
+
+using frame = std::array<std::uint8_t, 8>;
+using clock = std::chrono::steady_clock;
+
+struct settings
+{
+    std::chrono::milliseconds min_interval {1000};  // also the floor of the pong timeout
+    std::chrono::milliseconds max_interval {10000}; // pings of an idle, steady link
+    std::size_t               max_missed   {3};     // pongs missed in a row before the peer is dead
+};
+
+/*
+ Ping and pong, sent by both ends of a control connection:
+ +------+--------+--------------------+
+ | 0x04 | status | sender's timestamp |   ping
+ | 0x05 | status | the ping's stamp   |   pong
+ +------+--------+--------------------+
+ |  1   |   1    | 6 (big endian, us) |
+ +------+--------+--------------------+
+ Only the sender reads its timestamps back, the clocks of both ends need not agree.
+*/
+constexpr std::uint64_t stamp_mask {(std::uint64_t{1} << 48) - 1};
+
+inline
+std::uint64_t stamp(clock::time_point t)
+{
+    auto const us = std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+    return static_cast<std::uint64_t>(us) & stamp_mask;
+}
+
+inline
+frame ping(clock::time_point now)
+{
+    std::uint64_t const s = stamp(now);
+    frame f {0x04 /* PING */, 0x00};
+    for (std::size_t i = 0; i < 6; i++)
+        f[2 + i] = static_cast<std::uint8_t>(s >> (40 - 8 * i));
+    return f;
+}
+
+inline
+frame pong(frame const & ping)
+{
+    frame f = ping;
+    f[0] = 0x05; // PONG
+    f[1] = 0x00;
+    return f;
+}
+
+inline
+std::uint64_t read_stamp(frame const & f)
+{
+    std::uint64_t s = 0;
+    for (std::size_t i = 0; i < 6; i++)
+        s = s << 8 | f[2 + i];
+    return s;
+}
+
+// Round-trip estimate and ping schedule of one control connection, smoothed
+// like TCP's retransmission timer (RFC 6298). The interval doubles up to
+// max_interval while pongs come back, a missed pong is retried at once.
+// A peer that neither pings nor answers is an older build without pongs:
+// it gets plain keep-alive pings and is only declared dead once nothing at
+// all came from it for max_missed * max_interval.
+class probe
+{
+    settings settings_;
+    clock::duration srtt_ {0};
+    clock::duration rttvar_ {0};
+    clock::duration interval_;
+    clock::time_point heard_;
+    std::size_t missed_ {0};
+    bool outstanding_ {false};
+    bool answered_ {false};
+    bool pings_ {false};
+public:
+    explicit probe(settings const & s = {}):
+        settings_{s},
+        interval_{s.min_interval},
+        heard_{clock::now()} {}
+
+    // Every frame read from the peer; one that pings answers pings too
+    void heard(frame const & f)
+    {
+        heard_ = clock::now();
+        if (f[0] == 0x04 /* PING */)
+            pings_ = true;
+    }
+
+    // Wait before the next ping
+    clock::duration interval() const { return missed_? clock::duration::zero(): interval_; }
+
+    // Wait for its pong
+    clock::duration timeout() const
+    {
+        return std::max<clock::duration>(settings_.min_interval, srtt_ + 4 * rttvar_);
+    }
+
+    frame ping()
+    {
+        outstanding_ = true;
+        return keepalive::ping(clock::now());
+    }
+
+    void pong(frame const & f)
+    {
+        clock::duration const rtt = std::chrono::microseconds{(stamp(clock::now()) - read_stamp(f)) & stamp_mask};
+        if (answered_)
+        {
+            rttvar_ = (3 * rttvar_ + (srtt_ > rtt? srtt_ - rtt: rtt - srtt_)) / 4;
+            srtt_   = (7 * srtt_ + rtt) / 8;
+        }
+        else
+        {
+            srtt_   = rtt;
+            rttvar_ = rtt / 2;
+        }
+        answered_    = true;
+        outstanding_ = false;
+        missed_      = 0;
+        // a long round trip is not worth probing more often than a few times per RTT
+        clock::duration const floor = std::max<clock::duration>(settings_.min_interval, 8 * srtt_);
+        interval_ = std::min<clock::duration>(settings_.max_interval, std::max(floor, 2 * interval_));
+    }
+
+    // Called once timeout() passed after a ping; false when the peer is dead
+    bool settle()
+    {
+        if (not answered_ && not pings_)
+        {
+            outstanding_ = false;
+            interval_    = settings_.max_interval;
+            return clock::now() - heard_ < settings_.max_missed * settings_.max_interval;
+        }
+        if (not outstanding_)
+            return true;
+        outstanding_ = false;
+        return ++missed_ < settings_.max_missed;
+    }
+
+    bool answered() const { return answered_; }
+    std::size_t missed() const { return missed_; }
+    clock::duration srtt() const { return srtt_; }
+    clock::duration rttvar() const { return rttvar_; }
+
+    void report(std::ostream & os) const
+    {
+        using ms = std::chrono::duration<double, std::milli>;
+        if (not answered_)
+            os << "rtt unknown";
+        else
+            os << "rtt " << ms{srtt_}.count() << " ms +/- " << ms{rttvar_}.count() << " ms";
+        os << ", ping every " << ms{interval_}.count() / 1000 << " s, missed " << missed_;
+    }
+};
+
+// Pings the peer on `remote` until it misses too many pongs, then returns.
+// Frames reach `p` through whoever reads the connection. Throws when a write
+// fails; a ping not in the socket within the pong timeout, e.g. queued behind
+// another writer's frame stuck on a full send buffer, closes the connection.
+template<typename Stream>
+lib::awaitable<void> watch(Stream & remote, probe & p)
+{
+    auto executor = co_await lib::this_coro::executor();
+    auto token    = co_await lib::this_coro::token();
+
+    boost::asio::steady_timer timer{executor.context()};
+    for (;;)
+    {
+        timer.expires_after(p.interval());
+        co_await timer.async_wait(token);
+        co_await remote.released(); // a held connection is not pinged, nor timed out for it
+        {
+            util::deadline const bound{executor.context(), p.timeout(), [&remote] {
+                boost::system::error_code ec;
+                remote.lowest_layer().close(ec);
+            }};
+            co_await remote.write_frame(p.ping());
+        }
+
+        timer.expires_after(p.timeout());
+        co_await timer.async_wait(token);
+        if (not p.settle())
+            co_return;
+    }
+}
+
+}// namespace pika::keepalive
+
+#endif // KEEPALIVE_HPP_
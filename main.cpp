@@ -1,5 +1,8 @@
 #include <boost/program_options.hpp>
+#include <filesystem>
 #include <sstream>
+#include <fstream>
+#include <optional>
 #include "socks5_server.hpp"
 #include "controller.hpp"
 #include "client.hpp"
@@ -12,21 +15,58 @@ int main(int argc, char *argv[])
         enum class mode {
             srv,
             exp,
-            socks5
+            socks5,
+            summary,
+            pool
         };
         mode run_mode {mode::srv};
-        std::string srv_listen_host, socks5_listen_host, connect_host, export_host, bind_host;
-        std::unique_ptr<pika::lib::tcp::socket> socks5_server_endpoint_socket {nullptr};
+        std::string srv_listen_host, routed_host, socks5_listen_host, connect_host, export_host, bind_host;
+        bool embedded_socks5 {false};
+        std::filesystem::path embedded_socks5_path; // removed on exit
+        BOOST_SCOPE_EXIT_ALL (&embedded_socks5_path) {
+            std::error_code ec;
+            if (not embedded_socks5_path.empty())
+                std::filesystem::remove(embedded_socks5_path, ec);
+        };
         boost::asio::io_context io_context;
+        pika::admission::limits limits;
+        pika::tls::options tls_options;
+        std::shared_ptr<pika::tls::context> tls;
+        double trace_rate {0};
+        std::string trace_file, trace_admin;
+        std::shared_ptr<pika::trace::collector> tracer;
+        std::string config_file;
+        std::optional<pika::config::settings> cfg;
+        pika::keepalive::settings keepalive;
+        double keepalive_interval {10};
+        std::size_t upgrade_drain {60};
 
         po::options_description desc{"Options"};
         desc.add_options()
             ("help,h", "Print this help messages")
-            ("srv",    po::value<std::string>(&srv_listen_host)->default_value(":7000"), "[server mode] listen port")
-            ("connect,c", po::value<std::string>(), "[export mode] connect to server")
-            ("export,e",  po::value<std::string>(), "[export mode] export server endpoint")
-            ("bind,b",    po::value<std::string>(), "[export mode] bind remote server")
-            ("socks5,s",  po::value<std::string>(), "[socks5 mode] start socks5 server on this port");
+            ("config,f", po::value<std::string>(&config_file), "read srv, limits, connect and tunnels from this file, reloaded on SIGHUP")
+            ("srv",    po::value<std::string>(&srv_listen_host)->default_value(":7000"), "[server mode] listen port, or unix:/path")
+            ("routed", po::value<std::string>(&routed_host), "[server mode] public port shared by route:<hostname> tunnels, dispatched by TLS SNI or HTTP Host")
+            ("connect,c", po::value<std::string>(), "[export mode] connect to server, host:port or unix:/path")
+            ("export,e",  po::value<std::string>(), "[export mode] export server endpoint, host:port or unix:/path")
+            ("bind,b",    po::value<std::string>(), "[export mode] bind remote server, or route:<hostname> on its routed port")
+            ("socks5,s",  po::value<std::string>(), "[socks5 mode] start socks5 server on this port, or unix:/path")
+            ("max-bridges",        po::value<std::size_t>(&limits.max_bridges)->default_value(0),        "concurrent bridges in total, 0 for unlimited")
+            ("max-tunnel-bridges", po::value<std::size_t>(&limits.max_tunnel_bridges)->default_value(0), "concurrent bridges per listening port, 0 for unlimited")
+            ("accept-rate",        po::value<double>(&limits.accept_rate)->default_value(0),             "accepted connections per second per listening port, 0 for unlimited")
+            ("memory-budget",      po::value<std::size_t>(&limits.memory_budget)->default_value(0),      "pause accepting past this many bytes of connection buffers, 0 for unlimited")
+            ("tls-cert", po::value<std::string>(&tls_options.cert), "[server mode] enable TLS with this certificate chain; [export mode] client certificate")
+            ("tls-key",  po::value<std::string>(&tls_options.key),  "private key of --tls-cert, defaults to the same file")
+            ("tls-ca",   po::value<std::string>(&tls_options.ca),   "[export mode] enable TLS and verify the server with this CA; [server mode] require client certificates")
+            ("no-ktls",  "keep TLS record encryption in userspace")
+            ("keepalive-interval", po::value<double>(&keepalive_interval)->default_value(10), "longest wait between pings on the control connection, in seconds")
+            ("keepalive-misses",   po::value<std::size_t>(&keepalive.max_missed)->default_value(3), "unanswered pings in a row before the other end is considered dead")
+            ("upgrade-drain",    po::value<std::size_t>(&upgrade_drain)->default_value(60), "[server mode] on SIGUSR2, seconds the old process lets its bridges finish")
+            ("upgrade-controls", "[server mode] on SIGUSR2, also hand plaintext and kTLS control connections to the new process")
+            ("trace-rate",    po::value<double>(&trace_rate)->default_value(0), "[server mode] fraction of public connections to trace, 0 to 1")
+            ("trace-file",    po::value<std::string>(&trace_file),  "append trace spans to this file")
+            ("trace-admin",   po::value<std::string>(&trace_admin), "stream trace spans to readers connecting to this port")
+            ("trace-summary", po::value<std::vector<std::string>>()->multitoken(), "[summary mode] print stage latency percentiles of these trace files");
         po::positional_options_description pos_po;
         po::variables_map vm;
 
@@ -35,7 +75,31 @@ int main(int argc, char *argv[])
                   .positional(pos_po).run(),
                   vm);
         po::notify(vm);
-        if (vm.count("connect") || vm.count("export") || vm.count("bind"))
+        tls_options.ktls = not vm.count("no-ktls");
+        keepalive.max_interval = std::max(keepalive.min_interval,
+                                          std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::duration<double>{keepalive_interval}));
+        if (vm.count("trace-summary"))
+            run_mode = mode::summary;
+        else if (not config_file.empty())
+        {
+            // the file's limits apply, also on every reload
+            for (char const * limit : {"max-bridges", "max-tunnel-bridges", "accept-rate", "memory-budget"})
+                if (not vm[limit].defaulted())
+                {
+                    std::cerr << "--" << limit << " cannot be combined with --config, set it in the config file\n";
+                    std::exit(1);
+                }
+            cfg = pika::config::load(config_file);
+            limits = cfg->limits;
+            if (cfg->client_side())
+                run_mode = mode::pool;
+            else
+            {
+                run_mode = mode::srv;
+                srv_listen_host = cfg->srv.front();
+            }
+        }
+        else if (vm.count("connect") || vm.count("export") || vm.count("bind"))
         {
             run_mode = mode::exp;
             if ((!! vm.count("connect")) ^ (!! vm.count("bind")))
@@ -50,11 +114,11 @@ int main(int argc, char *argv[])
             if (not vm.count("export"))
             {
                 std::cout << "[export mode] --export not present, using internal socks5 server\n";
-                socks5_server_endpoint_socket = std::make_unique<pika::lib::tcp::socket>(io_context,
-                                                                                         pika::lib::tcp::endpoint{pika::lib::tcp::v4(), 0});
-
-                using namespace std::literals;
-                export_host = "127.0.0.1:"s + std::to_string(socks5_server_endpoint_socket->local_endpoint().port());
+                // the hop never leaves this host, so skip the loopback TCP stack
+                embedded_socks5 = true;
+                embedded_socks5_path = std::filesystem::temp_directory_path() /
+                    ("reverse-tunnel-socks5-" + std::to_string(::getpid()) + ".sock");
+                export_host = std::string{pika::util::unix_prefix} + embedded_socks5_path.string();
             }
             else
                 export_host = vm["export"].as<std::string>();
@@ -67,9 +131,119 @@ int main(int argc, char *argv[])
         else
             run_mode = mode::srv;
 
+        // any TLS option asks for TLS, a half configured one must not fall back to plaintext
+        bool const tls_requested = not tls_options.cert.empty() || not tls_options.key.empty() || not tls_options.ca.empty();
+        if (run_mode == mode::srv && tls_requested)
+        {
+            if (tls_options.cert.empty())
+            {
+                std::cerr << "[server mode] --tls-key and --tls-ca need --tls-cert\n";
+                std::exit(1);
+            }
+            tls = std::make_shared<pika::tls::context>(tls_options, pika::tls::context::role::controller);
+        }
+        else if ((run_mode == mode::exp || run_mode == mode::pool) && tls_requested)
+        {
+            if (tls_options.ca.empty())
+            {
+                std::cerr << "[export mode] TLS needs --tls-ca to verify the server\n";
+                std::exit(1);
+            }
+            std::string const & host = run_mode == mode::exp? connect_host: cfg->connect;
+            try
+            {
+                if (pika::tls::server_name(host).empty())
+                    std::cout << "[export mode] TLS over " << host << " verifies the server's certificate chain, not its name\n";
+            }
+            catch (std::invalid_argument const & e)
+            {
+                std::cerr << "[export mode] " << e.what() << "\n";
+                std::exit(1);
+            }
+            tls = std::make_shared<pika::tls::context>(tls_options, pika::tls::context::role::client);
+        }
+
         boost::asio::signal_set signals{io_context, SIGINT, SIGTERM};
         signals.async_wait([&](auto, auto){ io_context.stop(); });
 
+        if (run_mode == mode::summary)
+        {
+            std::stringstream spans;
+            for (std::string const & file : vm["trace-summary"].as<std::vector<std::string>>())
+            {
+                std::ifstream in{file};
+                if (not in)
+                    throw std::runtime_error("cannot open trace file " + file);
+                spans << in.rdbuf();
+            }
+            pika::trace::summarize(spans, std::cout);
+            return 0;
+        }
+
+        if (not trace_file.empty() || not trace_admin.empty())
+        {
+            tracer = std::make_shared<pika::trace::collector>(io_context, trace_rate, trace_file);
+            if (not trace_admin.empty())
+                pika::lib::co_spawn(io_context,
+                                    [tracer, ep = pika::util::make_connectable(trace_admin, io_context)] {
+                                        return tracer->serve(ep);
+                                    }, pika::lib::detached);
+        }
+
+        pika::admission admission{limits};
+        boost::asio::signal_set report_signals{io_context, SIGUSR1};
+        std::function<void(std::ostream &)> report_tunnels;
+        std::function<void()> wait_report = [&] {
+            report_signals.async_wait([&](boost::system::error_code const & ec, int) {
+                if (ec)
+                    return;
+                admission.report(std::cout);
+                if (report_tunnels)
+                    report_tunnels(std::cout);
+                wait_report();
+            });
+        };
+        wait_report();
+
+        boost::asio::signal_set reload_signals{io_context, SIGHUP};
+        std::function<void(pika::config::settings const &)> apply_config;
+        std::function<void()> wait_reload = [&] {
+            reload_signals.async_wait([&](boost::system::error_code const & ec, int) {
+                if (ec)
+                    return;
+                try
+                {
+                    std::cout << "reloading " << config_file << "\n";
+                    apply_config(pika::config::load(config_file));
+                }
+                catch (std::exception const & e)
+                {
+                    std::cerr << "reload failed, keeping the running config: " << e.what() << std::endl;
+                }
+                wait_reload();
+            });
+        };
+        if (cfg)
+            wait_reload();
+
+        boost::asio::signal_set upgrade_signals{io_context, SIGUSR2};
+        std::function<void()> hand_off;
+        std::function<void()> wait_upgrade = [&] {
+            upgrade_signals.async_wait([&](boost::system::error_code const & ec, int) {
+                if (ec)
+                    return;
+                try
+                {
+                    hand_off();
+                }
+                catch (std::exception const & e)
+                {
+                    std::cerr << "upgrade failed, keeping on: " << e.what() << std::endl;
+                    wait_upgrade();
+                }
+            });
+        };
+
         bool restart{true};
         while (restart)
         {
@@ -81,7 +255,7 @@ int main(int argc, char *argv[])
                 case mode::socks5:
                 {
                     std::cout << "[socks5 mode] ";
-                    pika::socks5::server server{socks5_listen_host, io_context};
+                    pika::socks5::server server{socks5_listen_host, io_context, admission};
                     pika::lib::co_spawn(io_context,
                                         [&server] {
                                             return server.run();
@@ -89,39 +263,77 @@ int main(int argc, char *argv[])
                     io_context.run();
                     break;
                 }
+                case mode::summary:
+                    break;
                 case mode::srv:
                 {
-                    pika::controller server{srv_listen_host, io_context};
+                    pika::controller server{srv_listen_host, io_context, admission, tls, tracer, keepalive};
+                    report_tunnels = [&server](std::ostream & os) { server.report(os); };
+                    if (auto channel = pika::upgrade::inherited())
+                    {
+                        pika::upgrade::announce(*channel);
+                        server.adopt(pika::upgrade::take_over(*channel));
+                        pika::upgrade::acknowledge(*channel);
+                        std::cout << "upgrade: took over from pid " << ::getppid() << "\n";
+                    }
+                    hand_off = [&server, &io_context, &wait_upgrade, argv, upgrade_drain, controls = vm.count("upgrade-controls") > 0] {
+                        pika::upgrade::child const child = pika::upgrade::spawn(argv);
+                        pika::lib::co_spawn(io_context,
+                                            [&server, &wait_upgrade, child, upgrade_drain, controls] {
+                                                return pika::upgrade::replace(server, child, controls,
+                                                                              std::chrono::seconds{upgrade_drain}, wait_upgrade);
+                                            }, pika::lib::detached);
+                    };
+                    wait_upgrade();
                     pika::lib::co_spawn(io_context,
                                         [&server] {
                                             return server.run();
                                         }, pika::lib::detached);
+                    if (cfg)
+                    {
+                        apply_config = [&server](pika::config::settings const & c) { server.reconfigure(c); };
+                        server.reconfigure(*cfg);
+                    }
+                    else
+                        server.set_routed(routed_host);
+                    io_context.run();
+                    break;
+                }
+                case mode::pool:
+                {
+                    pika::client_pool pool{io_context, tls, tracer, keepalive};
+                    apply_config = [&pool](pika::config::settings const & c) { pool.reconfigure(c); };
+                    report_tunnels = [&pool](std::ostream & os) { pool.report(os); };
+                    pool.reconfigure(*cfg);
                     io_context.run();
                     break;
                 }
                 case mode::exp:
                 {
-                    // if socks5_server_endpoint_socket not null, start socks5 server
-                    if (socks5_server_endpoint_socket)
+                    // started once, it outlives restarts of the client
+                    if (std::exchange(embedded_socks5, false))
                     {
+                        // listening before the client can dial it, served on a thread of its own
+                        std::cout << "Starting socks5 server at " << export_host << "\n";
+                        auto io     = std::make_shared<boost::asio::io_context>();
+                        auto server = std::make_shared<pika::socks5::server>(export_host, *io, admission);
                         std::thread t(
-                            [socket = std::move(socks5_server_endpoint_socket), &export_host]() mutable
+                            [io, server]() mutable
                             {
-                                // retrive the random port from socket, release it, than bind it again
-                                using namespace std::literals;
-                                std::cout << "Starting socks5 server at " << export_host << "\n";
-                                socket.reset();
-                                boost::asio::io_context io;
-                                pika::socks5::server server {export_host, io};
-                                pika::lib::co_spawn(io,
-                                                    [&server] {
-                                                        return server.run();
+                                pika::lib::co_spawn(*io,
+                                                    [server] {
+                                                        return server->run();
                                                     }, pika::lib::detached);
-                                io.run();
+                                io->run();
                             });
                         t.detach();
                     }
-                    auto c = std::make_shared<pika::client>(export_host, io_context);
+                    auto c = std::make_shared<pika::client>(export_host, io_context, tls, tracer, keepalive);
+                    report_tunnels = [c, &bind_host](std::ostream & os) {
+                        os << "tunnel " << bind_host << ": ";
+                        c->report(os);
+                        os << "\n";
+                    };
                     pika::lib::co_spawn(io_context,
                                         [&c, &connect_host, &bind_host, &req] {
                                             return c->run(connect_host, bind_host, req);
@@ -0,0 +1,213 @@
+#ifndef ROUTE_HPP_
+#define ROUTE_HPP_
+
+#pragma once
+
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+#include "basic.hpp"
+
+namespace pika::route
+{
+
+// A tunnel bound to "route:<hostname>" shares the controller's routed
+// listener with other tunnels instead of getting a port of its own.
+constexpr std::string_view prefix {"route:"};
+constexpr std::size_t max_name {253};
+// one full TLS record; an HTTP request head must fit in it as well
+constexpr std::size_t max_peek {5 + 16 * 1024};
+
+inline
+bool is_route(std::string_view bind)
+{
+    return bind.substr(0, prefix.size()) == prefix;
+}
+
+/*
+ Route request, client to controller:
+ +------+--------+-------------+---------+
+ | 0x06 | status | name length | unused  |   8-byte frame
+ +------+--------+-------------+---------+
+ |  1   |   1    |  2 (big e.) |    4    |
+ +------+--------+-------------+---------+
+ followed by the hostname, zero padded to whole 8-byte frames
+*/
+inline
+std::size_t padded(std::size_t name_length)
+{
+    return (name_length + 7) / 8 * 8;
+}
+
+inline
+std::vector<std::array<std::uint8_t, 8>> request(std::string_view name)
+{
+    if (name.empty() || name.size() > max_name)
+        throw std::runtime_error("route: bad hostname length");
+
+    std::vector<std::array<std::uint8_t, 8>> frames(1 + padded(name.size()) / 8);
+    frames[0] = {0x06, 0x00,
+                 static_cast<std::uint8_t>(name.size() >> 8),
+                 static_cast<std::uint8_t>(name.size() & 0xFF)};
+    for (std::size_t i = 0; i < name.size(); i++)
+        frames[1 + i / 8][i % 8] = static_cast<std::uint8_t>(name[i]);
+    return frames;
+}
+
+// Hostnames compare case-insensitively, so the names peeked from a
+// connection are looked up as they are, without a lowered copy.
+struct host_hash
+{
+    std::size_t operator()(std::string_view name) const noexcept
+    {
+        std::size_t h = 14695981039346656037ull; // FNV-1a
+        for (char c : name)
+        {
+            h ^= static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(c)));
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+};
+
+struct host_equal
+{
+    bool operator()(std::string_view a, std::string_view b) const noexcept
+    {
+        if (a.size() != b.size())
+            return false;
+        for (std::size_t i = 0; i < a.size(); i++)
+            if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+                return false;
+        return true;
+    }
+};
+
+enum class verdict
+{
+    found,      // host points into the peeked bytes
+    incomplete, // peek again once more bytes arrived
+    unroutable  // no hostname in there, drop the connection
+};
+
+struct sniffed
+{
+    verdict v;
+    std::string_view host {};
+};
+
+namespace detail
+{
+
+// server_name extension of the ClientHello in the first TLS record (RFC 6066 section 3)
+inline
+sniffed client_hello(std::string_view data)
+{
+    util::reader record{data};
+    record.skip(3); // content type, legacy version
+    std::size_t const length = record.number(2);
+    if (not record.ok())
+        return {verdict::incomplete};
+    if (length > max_peek - 5)
+        return {verdict::unroutable};
+
+    std::string_view const body = record.bytes(length);
+    if (not record.ok())
+        return {verdict::incomplete};
+
+    util::reader hello{body};
+    if (hello.number(1) != 0x01 /* client_hello */)
+        return {verdict::unroutable};
+    hello.skip(3);              // handshake length, a hello split over records is not routed
+    hello.skip(2 + 32);         // legacy version, random
+    hello.skip(hello.number(1)); // session id
+    hello.skip(hello.number(2)); // cipher suites
+    hello.skip(hello.number(1)); // compression methods
+
+    util::reader extensions{hello.bytes(hello.number(2))};
+    while (hello.ok() && extensions.ok() && not extensions.empty())
+    {
+        std::size_t const type = extensions.number(2);
+        std::string_view const ext = extensions.bytes(extensions.number(2));
+        if (type != 0x0000 /* server_name */)
+            continue;
+
+        util::reader names{ext};
+        util::reader list{names.bytes(names.number(2))};
+        while (list.ok() && not list.empty())
+        {
+            std::size_t const name_type = list.number(1);
+            std::string_view const name = list.bytes(list.number(2));
+            if (list.ok() && name_type == 0x00 /* host_name */ && not name.empty() && name.size() <= max_name)
+                return {verdict::found, name};
+        }
+    }
+    return {verdict::unroutable};
+}
+
+inline
+std::string_view trim(std::string_view s)
+{
+    while (not s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (not s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+// Host header of an HTTP/1.x request head, without the port
+inline
+sniffed http_host(std::string_view data)
+{
+    if (not std::isupper(static_cast<unsigned char>(data.front()))) // request method
+        return {verdict::unroutable};
+
+    std::size_t pos = data.find("\r\n");
+    if (pos == std::string_view::npos)
+        return {data.size() < max_peek? verdict::incomplete: verdict::unroutable};
+
+    for (pos += 2;;)
+    {
+        std::size_t const end = data.find("\r\n", pos);
+        if (end == std::string_view::npos)
+            return {data.size() < max_peek? verdict::incomplete: verdict::unroutable};
+        if (end == pos) // blank line, end of the head
+            return {verdict::unroutable};
+
+        std::string_view const line = data.substr(pos, end - pos);
+        pos = end + 2;
+        std::size_t const colon = line.find(':');
+        if (colon == std::string_view::npos || not host_equal{}(line.substr(0, colon), "host"))
+            continue;
+
+        std::string_view host = trim(line.substr(colon + 1));
+        if (not host.empty() && host.front() == '[') // IPv6 literal
+            host = host.substr(0, host.find(']') + 1);
+        else
+            host = host.substr(0, host.find(':'));
+        if (host.empty() || host.size() > max_name)
+            return {verdict::unroutable};
+        return {verdict::found, host};
+    }
+}
+
+}// namespace detail
+
+// Hostname from the first bytes a client sent: TLS ClientHello SNI or HTTP Host.
+// Never copies; `host` points into `data`.
+inline
+sniffed sniff(std::string_view data)
+{
+    if (data.empty())
+        return {verdict::incomplete};
+    if (static_cast<std::uint8_t>(data.front()) == 0x16 /* TLS handshake record */)
+        return detail::client_hello(data);
+    return detail::http_host(data);
+}
+
+}// namespace pika::route
+
+#endif // ROUTE_HPP_
@@ -0,0 +1,493 @@
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+#include "socks5_server.hpp"
+#include "controller.hpp"
+#include "client.hpp"
+
+// Connection-churn soak test: drives many short connections through
+// controller+client and the socks5 server on loopback, including resets,
+// half-closes, split TLS ClientHellos on the routed port, half-open control
+// connections and refused backends, and fails when fds, memory, pending
+// controller entries or live bridges/sessions keep growing, or when more
+// than a small fraction of a scenario's connections fail.
+
+namespace
+{
+
+using namespace pika;
+using namespace std::chrono_literals;
+
+struct sample
+{
+    std::size_t fds;
+    std::size_t rss;
+    std::size_t pending;
+    std::size_t bridges;
+    std::size_t sessions;
+};
+
+std::size_t open_fds()
+{
+    std::size_t n = 0;
+    for ([[maybe_unused]] auto const & entry : std::filesystem::directory_iterator{"/proc/self/fd"})
+        n++;
+    return n;
+}
+
+std::size_t resident_bytes()
+{
+    std::ifstream statm{"/proc/self/statm"};
+    std::size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+}
+
+lib::tcp::endpoint loopback(std::uint16_t port)
+{
+    return lib::tcp::endpoint{boost::asio::ip::address_v4::loopback(), port};
+}
+
+std::uint16_t free_port(boost::asio::io_context &io_context)
+{
+    lib::tcp::acceptor acceptor{io_context, loopback(0)};
+    return acceptor.local_endpoint().port();
+}
+
+lib::awaitable<void> echo(lib::tcp::socket socket)
+{
+    auto token = co_await lib::this_coro::token();
+    try
+    {
+        std::array<char, 1024> buf;
+        for (;;)
+        {
+            std::size_t n = co_await socket.async_read_some(boost::asio::buffer(buf), token);
+            std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(buf, n), token);
+        }
+    }
+    catch (std::exception const &) {}
+}
+
+lib::awaitable<void> echo_server(lib::tcp::acceptor & acceptor)
+{
+    auto executor = co_await lib::this_coro::executor();
+    auto token    = co_await lib::this_coro::token();
+    for (;;)
+    {
+        lib::tcp::socket socket = co_await acceptor.async_accept(token);
+        lib::co_spawn(executor,
+                      [socket = std::move(socket)]() mutable {
+                          return echo(std::move(socket));
+                      }, lib::detached);
+    }
+}
+
+class driver
+{
+public:
+    enum scenario
+    {
+        tunnel_echo,    // full round trip through the tunnel
+        tunnel_reset,   // RST right after the first write
+        tunnel_half_close, // shut down the sending side without a byte
+        tunnel_refused, // the client cannot reach its export
+        socks5_echo,    // round trip through the socks5 server
+        socks5_refused, // socks5 CONNECT to a closed port
+        routed_split_hello, // a ClientHello in two writes to the routed port, the SNI in the second
+        control_half_open, // bind a tunnel, then neither read nor write until the server drops it
+        scenario_count
+    };
+
+    static constexpr std::array<char const *, scenario_count> names {
+        "tunnel_echo", "tunnel_reset", "tunnel_half_close", "tunnel_refused", "socks5_echo", "socks5_refused",
+        "routed_split_hello", "control_half_open"
+    };
+
+    // each half-open control connection sits for a keepalive timeout, they
+    // run in a few batches per round instead of taking turns with the rest
+    static constexpr std::size_t churned_scenarios = control_half_open;
+    static constexpr std::size_t half_open_per_round = 4;
+
+    static constexpr std::string_view routed_name {"soak.test"};
+
+    lib::tcp::endpoint control_ep, routed_ep, tunnel_ep, refused_tunnel_ep, socks5_ep, echo_ep, closed_ep;
+    std::chrono::milliseconds half_open_wait; // the server must have dropped a silent peer by then
+    std::array<std::uint64_t, scenario_count> runs{};
+    std::array<std::uint64_t, scenario_count> failures{};
+
+    lib::awaitable<void> round(std::size_t connections, std::size_t concurrency)
+    {
+        auto executor = co_await lib::this_coro::executor();
+        auto token    = co_await lib::this_coro::token();
+
+        std::size_t next = 0, running = 0;
+        boost::asio::steady_timer done{executor.context(), std::chrono::steady_clock::time_point::max()};
+        for (std::size_t w = 0; w < concurrency; w++)
+        {
+            running++;
+            lib::co_spawn(executor,
+                          [this, &next, &running, &done, connections]() -> lib::awaitable<void> {
+                              while (next < connections)
+                                  co_await attempt(static_cast<scenario>(next++ % churned_scenarios));
+                              if (--running == 0)
+                                  done.cancel();
+                          }, lib::detached);
+        }
+        for (std::size_t h = 0; h < half_open_per_round; h++)
+        {
+            running++;
+            lib::co_spawn(executor,
+                          [this, &running, &done]() -> lib::awaitable<void> {
+                              co_await attempt(control_half_open);
+                              if (--running == 0)
+                                  done.cancel();
+                          }, lib::detached);
+        }
+
+        try
+        {
+            co_await done.async_wait(token);
+        }
+        catch (boost::system::system_error const &) {}
+    }
+
+private:
+    lib::awaitable<void> attempt(scenario s)
+    {
+        runs[s]++;
+        try
+        {
+            co_await run(s);
+        }
+        catch (std::exception const &)
+        {
+            failures[s]++;
+        }
+    }
+
+    lib::awaitable<void> run(scenario s)
+    {
+        auto executor = co_await lib::this_coro::executor();
+        auto token    = co_await lib::this_coro::token();
+
+        // the deadline may fire after this frame is gone, it only holds a weak reference
+        auto conn = std::make_shared<lib::tcp::socket>(executor.context());
+        lib::tcp::socket & socket = *conn;
+        std::array<std::uint8_t, 64> payload{};
+        std::array<std::uint8_t, 64> reply{};
+        boost::asio::steady_timer deadline{executor.context(), half_open_wait + 10s};
+        deadline.async_wait([weak = std::weak_ptr<lib::tcp::socket>{conn}](boost::system::error_code const & ec) {
+            boost::system::error_code ignored;
+            if (auto s = weak.lock(); s && not ec)
+                s->close(ignored);
+        });
+
+        switch (s)
+        {
+            case tunnel_echo:
+                co_await socket.async_connect(tunnel_ep, token);
+                std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(payload), token);
+                std::ignore = co_await boost::asio::async_read(socket, boost::asio::buffer(reply), token);
+                socket.shutdown(lib::tcp::socket::shutdown_send);
+                co_await expect_eof(socket);
+                break;
+            case tunnel_reset:
+                co_await socket.async_connect(tunnel_ep, token);
+                std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(payload), token);
+                socket.set_option(boost::asio::socket_base::linger{true, 0});
+                socket.close();
+                break;
+            case tunnel_half_close:
+                co_await socket.async_connect(tunnel_ep, token);
+                socket.shutdown(lib::tcp::socket::shutdown_send);
+                co_await expect_eof(socket);
+                break;
+            case tunnel_refused:
+                co_await socket.async_connect(refused_tunnel_ep, token);
+                co_await expect_eof(socket);
+                break;
+            case socks5_echo:
+            case socks5_refused:
+            {
+                co_await socket.async_connect(socks5_ep, token);
+                lib::tcp::endpoint const target = s == socks5_echo? echo_ep: closed_ep;
+                std::array<std::uint8_t, 3 + 10> hello{0x05, 0x01, 0x00,      // greeting
+                                                       0x05, 0x01, 0x00, 0x01}; // CONNECT ipv4
+                std::uint32_t ip = target.address().to_v4().to_ulong();
+                boost::endian::native_to_big_inplace(ip);
+                std::uint16_t port = target.port();
+                boost::endian::native_to_big_inplace(port);
+                std::memcpy(&hello[7],  &ip,   sizeof ip);
+                std::memcpy(&hello[11], &port, sizeof port);
+                std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(hello), token);
+
+                std::array<std::uint8_t, 2 + 10> answer{};
+                std::ignore = co_await boost::asio::async_read(socket, boost::asio::buffer(answer), token);
+                if (s == socks5_refused)
+                {
+                    if (answer[3] != 0x05 /* Connection refused */)
+                        throw std::runtime_error("socks5 refusal not reported");
+                    break;
+                }
+                if (answer[3] != 0x00)
+                    throw std::runtime_error("socks5 connect failed");
+                std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(payload), token);
+                std::ignore = co_await boost::asio::async_read(socket, boost::asio::buffer(reply), token);
+                socket.shutdown(lib::tcp::socket::shutdown_send);
+                co_await expect_eof(socket);
+                break;
+            }
+            case routed_split_hello:
+            {
+                co_await socket.async_connect(routed_ep, token);
+                std::vector<std::uint8_t> const hello = client_hello(routed_name);
+                std::size_t const first = hello.size() / 2;
+                std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(hello.data(), first), token);
+                boost::asio::steady_timer gap{executor.context(), 20ms};
+                co_await gap.async_wait(token);
+                std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(hello.data() + first, hello.size() - first), token);
+                // routed unchanged to the echo backend
+                std::vector<std::uint8_t> echoed(hello.size());
+                std::ignore = co_await boost::asio::async_read(socket, boost::asio::buffer(echoed), token);
+                if (echoed != hello)
+                    throw std::runtime_error("routed hello not echoed");
+                socket.shutdown(lib::tcp::socket::shutdown_send);
+                co_await expect_eof(socket);
+                break;
+            }
+            case control_half_open:
+            {
+                co_await socket.async_connect(control_ep, token);
+                std::array<std::uint8_t, 8> bind{0x01 /* BIND */, 0x00,
+                                                 127, 0, 0, 1}; // any free port on loopback
+                std::ignore = co_await boost::asio::async_write(socket, boost::asio::buffer(bind), token);
+                // leave the server's pings unread and unanswered past its keepalive
+                boost::asio::steady_timer silence{executor.context(), half_open_wait};
+                co_await silence.async_wait(token);
+                co_await expect_eof(socket);
+                break;
+            }
+            default:
+                break;
+        }
+        deadline.cancel();
+    }
+
+    // A TLS 1.3 style ClientHello in one record, with only a server_name extension
+    static
+    std::vector<std::uint8_t> client_hello(std::string_view name)
+    {
+        std::vector<std::uint8_t> ext {0x00, 0x00, 0, 0, 0, 0, 0x00 /* host_name */, 0, 0};
+        ext.insert(ext.end(), name.begin(), name.end());
+        auto put16 = [](std::vector<std::uint8_t> & v, std::size_t at, std::size_t n) {
+            v[at]     = static_cast<std::uint8_t>(n >> 8);
+            v[at + 1] = static_cast<std::uint8_t>(n & 0xFF);
+        };
+        put16(ext, 2, ext.size() - 4); // extension data
+        put16(ext, 4, ext.size() - 6); // server name list
+        put16(ext, 7, name.size());
+
+        std::vector<std::uint8_t> hello {0x01 /* client_hello */, 0, 0, 0, 0x03, 0x03};
+        hello.resize(hello.size() + 32);                     // random
+        hello.insert(hello.end(), {0x00,                     // session id
+                                   0x00, 0x02, 0x13, 0x01,   // TLS_AES_128_GCM_SHA256
+                                   0x01, 0x00,               // no compression
+                                   0, 0});                   // extensions length
+        put16(hello, hello.size() - 2, ext.size());
+        hello.insert(hello.end(), ext.begin(), ext.end());
+        hello[2] = static_cast<std::uint8_t>((hello.size() - 4) >> 8);
+        hello[3] = static_cast<std::uint8_t>((hello.size() - 4) & 0xFF);
+
+        std::vector<std::uint8_t> record {0x16 /* handshake */, 0x03, 0x01, 0, 0};
+        put16(record, 3, hello.size());
+        record.insert(record.end(), hello.begin(), hello.end());
+        return record;
+    }
+
+    static
+    lib::awaitable<void> expect_eof(lib::tcp::socket & socket)
+    {
+        auto token = co_await lib::this_coro::token();
+        std::array<char, 256> buf;
+        try
+        {
+            for (;;)
+                std::ignore = co_await socket.async_read_some(boost::asio::buffer(buf), token);
+        }
+        catch (boost::system::system_error const & e)
+        {
+            if (e.code() != boost::asio::error::eof &&
+                e.code() != boost::asio::error::connection_reset)
+                throw;
+        }
+    }
+};
+
+// A metric leaks when even the lowest sample of the second half of the run
+// sits well above the lowest of the first half. Noise only lifts single
+// samples, a leak lifts the floor.
+bool leaks(char const * name, std::vector<sample> const & samples, std::size_t sample::* metric, std::size_t slack)
+{
+    auto const half   = samples.begin() + static_cast<std::ptrdiff_t>(samples.size() / 2);
+    auto const lower  = [metric](sample const & a, sample const & b) { return a.*metric < b.*metric; };
+    std::size_t const before = (*std::min_element(samples.begin(), half, lower)).*metric;
+    std::size_t const after  = (*std::min_element(half, samples.end(), lower)).*metric;
+
+    if (after > before + slack)
+    {
+        std::cerr << "LEAK: " << name << " floor grew from " << before << " to " << after << "\n";
+        return true;
+    }
+    return false;
+}
+
+}// namespace
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        namespace po = boost::program_options;
+        std::size_t connections {1000000}, round_size {20000}, concurrency {128}, warmup {2};
+        std::size_t rss_slack_mib {64};
+        double max_failures {0.001};
+
+        po::options_description desc{"Options"};
+        desc.add_options()
+            ("help,h", "Print this help messages")
+            ("connections,n", po::value<std::size_t>(&connections)->default_value(1000000), "total connections to drive")
+            ("round,r",       po::value<std::size_t>(&round_size)->default_value(20000),    "connections between two samples")
+            ("concurrency,c", po::value<std::size_t>(&concurrency)->default_value(128),     "connections in flight")
+            ("warmup,w",      po::value<std::size_t>(&warmup)->default_value(2),            "rounds before the baseline sample")
+            ("rss-slack",     po::value<std::size_t>(&rss_slack_mib)->default_value(64),    "allowed resident memory growth, in MiB")
+            ("max-failures",  po::value<double>(&max_failures)->default_value(0.001),       "allowed fraction of failed connections per scenario");
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (vm.count("help"))
+        {
+            std::cout << desc << "\n";
+            return 0;
+        }
+
+        boost::asio::io_context io_context;
+        lib::tcp::acceptor echo_acceptor{io_context, loopback(0)};
+        std::uint16_t const echo_port    = echo_acceptor.local_endpoint().port();
+        std::uint16_t const closed_port  = free_port(io_context);
+        std::uint16_t const control_port = free_port(io_context);
+        std::uint16_t const tunnel_port  = free_port(io_context);
+        std::uint16_t const refused_port = free_port(io_context);
+        std::uint16_t const socks5_port  = free_port(io_context);
+        std::uint16_t const routed_port  = free_port(io_context);
+        auto host = [](std::uint16_t port) { return "127.0.0.1:" + std::to_string(port); };
+
+        // short enough for half-open control connections to go within a round
+        keepalive::settings const keepalive{500ms, 1000ms, 3};
+
+        admission admit;
+        controller server{host(control_port), io_context, admit, nullptr, nullptr, keepalive};
+        socks5::server socks5_server{host(socks5_port), io_context, admit};
+        auto exporter = std::make_shared<client>(host(echo_port), io_context);
+        auto refuser  = std::make_shared<client>(host(closed_port), io_context);
+        auto router   = std::make_shared<client>(host(echo_port), io_context);
+        server.set_routed(host(routed_port));
+
+        lib::co_spawn(io_context, [&] { return echo_server(echo_acceptor); }, lib::detached);
+        lib::co_spawn(io_context, [&] { return server.run(); }, lib::detached);
+        lib::co_spawn(io_context, [&] { return socks5_server.run(); }, lib::detached);
+        lib::co_spawn(io_context, [&] { return exporter->serve(host(control_port), host(tunnel_port)); }, lib::detached);
+        lib::co_spawn(io_context, [&] { return refuser->serve(host(control_port), host(refused_port)); }, lib::detached);
+        lib::co_spawn(io_context, [&] {
+            return router->serve(host(control_port), std::string{route::prefix} + std::string{driver::routed_name});
+        }, lib::detached);
+
+        driver d;
+        d.control_ep        = loopback(control_port);
+        d.routed_ep         = loopback(routed_port);
+        // a peer that never pings is dropped after max_missed silent max_intervals, settled once per ping
+        d.half_open_wait    = keepalive.max_missed * keepalive.max_interval + keepalive.max_interval
+                            + keepalive.min_interval + 1s;
+        d.tunnel_ep         = loopback(tunnel_port);
+        d.refused_tunnel_ep = loopback(refused_port);
+        d.socks5_ep         = loopback(socks5_port);
+        d.echo_ep           = loopback(echo_port);
+        d.closed_ep         = loopback(closed_port);
+
+        std::vector<sample> samples;
+        int exit_code = 0;
+        lib::co_spawn(io_context, [&]() -> lib::awaitable<void> {
+            auto executor = co_await lib::this_coro::executor();
+            auto token    = co_await lib::this_coro::token();
+
+            // let the clients bind their tunnels
+            boost::asio::steady_timer t{executor.context(), 500ms};
+            co_await t.async_wait(token);
+
+            std::size_t const rounds = (connections + round_size - 1) / round_size;
+            for (std::size_t r = 0; r < rounds; r++)
+            {
+                auto const started = std::chrono::steady_clock::now();
+                co_await d.round(round_size, concurrency);
+
+                // wait for the bridges of this round to wind down
+                for (int i = 0; i < 100 && (util::counted<bridge_tag>::live() || server.pending()); i++)
+                {
+                    t.expires_after(20ms);
+                    co_await t.async_wait(token);
+                }
+
+                sample const s{open_fds(), resident_bytes(), server.pending(),
+                               util::counted<bridge_tag>::live(), util::counted<socks5::session>::live()};
+                std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - started;
+                std::cout << "round " << r + 1 << "/" << rounds << ": "
+                          << static_cast<std::size_t>(round_size / elapsed.count()) << " conn/s"
+                          << ", fds "      << s.fds
+                          << ", rss "      << s.rss / (1024 * 1024) << " MiB"
+                          << ", pending "  << s.pending
+                          << ", bridges "  << s.bridges
+                          << ", sessions " << s.sessions << std::endl;
+                if (r + 1 >= warmup)
+                    samples.push_back(s);
+            }
+
+            // a few connections may fail on a busy loopback, a broken scenario fails them all
+            bool failed = false;
+            for (std::size_t s = 0; s < driver::scenario_count; s++)
+            {
+                if (not d.failures[s])
+                    continue;
+                bool const too_many = d.failures[s] > max_failures * d.runs[s];
+                std::cout << (too_many? "FAILED: ": "") << "scenario " << driver::names[s] << ": "
+                          << d.failures[s] << " of " << d.runs[s] << " connections failed\n";
+                failed |= too_many;
+            }
+
+            bool leaked = false;
+            if (samples.size() >= 2)
+            {
+                leaked |= leaks("fds",      samples, &sample::fds,      16);
+                leaked |= leaks("rss",      samples, &sample::rss,      rss_slack_mib * 1024 * 1024);
+                leaked |= leaks("pending",  samples, &sample::pending,  0);
+                leaked |= leaks("bridges",  samples, &sample::bridges,  0);
+                leaked |= leaks("sessions", samples, &sample::sessions, 0);
+            }
+            exit_code = leaked || failed? 1: 0;
+            std::cout << (exit_code? "soak FAILED\n": "soak passed\n");
+            executor.context().stop();
+        }, lib::detached);
+
+        io_context.run();
+        return exit_code;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception: " <<  e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,154 @@
+#ifndef SOCKS5_PARSER_HPP_
+#define SOCKS5_PARSER_HPP_
+
+#pragma once
+
+#include <string_view>
+#include "basic.hpp"
+
+namespace pika::socks5
+{
+
+// Parses the greeting and the request straight out of the session's
+// receive buffer, so a client pipelining both (and early payload) in one
+// segment costs a single read. Each call looks at everything received so
+// far and says how many bytes the message took once it is complete.
+enum class parse
+{
+    complete,
+    incomplete,
+    invalid
+};
+
+/*
+ +----+----------+----------+
+ |VER | NMETHODS | METHODS  |
+ +----+----------+----------+
+ | 1  |    1     | 1 to 255 |
+ +----+----------+----------+
+*/
+struct greeting
+{
+    bool no_auth {false}; // X'00' NO AUTHENTICATION REQUIRED offered
+};
+
+inline
+parse read_greeting(std::string_view data, std::size_t & consumed, greeting & g)
+{
+    util::reader r{data};
+    if (not data.empty() && r.number(1) != 0x05)
+        return parse::invalid;
+    std::string_view const methods = r.bytes(r.number(1));
+    if (not r.ok())
+        return parse::incomplete;
+
+    g.no_auth = methods.find('\0') != std::string_view::npos;
+    consumed  = r.position();
+    return parse::complete;
+}
+
+/*
+ +----+-----+-------+------+----------+----------+
+ |VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
+ +----+-----+-------+------+----------+----------+
+ | 1  |  1  | X'00' |  1   | Variable |    2     |
+ +----+-----+-------+------+----------+----------+
+*/
+struct request
+{
+    std::uint8_t reply {0x00};   // nonzero: refuse the request with this REP code
+    lib::tcp::endpoint endpoint; // ATYP X'01' and X'04'
+    std::string_view domain;     // ATYP X'03', points into the receive buffer
+    std::uint16_t port {0};
+};
+
+inline
+parse read_request(std::string_view data, std::size_t & consumed, request & req)
+{
+    util::reader r{data};
+    std::size_t const ver  = r.number(1);
+    std::size_t const cmd  = r.number(1);
+    r.skip(1);
+    std::size_t const atyp = r.number(1);
+    if (not r.ok())
+        return data.empty() || ver == 0x05? parse::incomplete: parse::invalid;
+    if (ver != 0x05)
+        return parse::invalid;
+
+    switch (atyp)
+    {
+        case 0x01: // IP V4 address
+        {
+            boost::asio::ip::address_v4::bytes_type ip;
+            std::string_view const addr = r.bytes(ip.size());
+            std::copy(addr.begin(), addr.end(), ip.begin());
+            req.endpoint.address(boost::asio::ip::address_v4{ip});
+            break;
+        }
+        case 0x03: // DOMAINNAME, one length octet first
+            req.domain = r.bytes(r.number(1));
+            break;
+        case 0x04: // IP V6 address
+        {
+            boost::asio::ip::address_v6::bytes_type ip;
+            std::string_view const addr = r.bytes(ip.size());
+            std::copy(addr.begin(), addr.end(), ip.begin());
+            req.endpoint.address(boost::asio::ip::address_v6{ip});
+            break;
+        }
+        default:
+            // the address length is unknown, nothing after it can be parsed
+            req.reply = 0x08; // Address type not supported
+            consumed  = r.position();
+            return parse::complete;
+    }
+    req.port = static_cast<std::uint16_t>(r.number(2));
+    if (not r.ok())
+        return parse::incomplete;
+
+    req.endpoint.port(req.port);
+    if (cmd != 0x01 /* CONNECT */)
+        req.reply = 0x07; // Command not supported
+    else if (atyp == 0x03 && req.domain.empty())
+        req.reply = 0x04; // Host unreachable, there is no host to resolve
+    consumed = r.position();
+    return parse::complete;
+}
+
+/*
+ +----+-----+-------+------+----------+----------+
+ |VER | REP |  RSV  | ATYP | BND.ADDR | BND.PORT |
+ +----+-----+-------+------+----------+----------+
+ | 1  |  1  | X'00' |  1   | Variable |    2     |
+ +----+-----+-------+------+----------+----------+
+*/
+using reply_buffer = std::array<std::uint8_t, 4 + 16 + 2>;
+
+// Returns the reply length: 10 bytes for an IPv4 BND.ADDR, 22 for IPv6
+inline
+std::size_t make_reply(reply_buffer & out, std::uint8_t rep, lib::tcp::endpoint const & bound = {})
+{
+    out = {0x05, rep, 0x00};
+    std::size_t n = 4;
+    if (bound.address().is_v6())
+    {
+        out[3] = 0x04;
+        auto const ip = bound.address().to_v6().to_bytes();
+        std::copy(ip.begin(), ip.end(), &out[n]);
+        n += ip.size();
+    }
+    else
+    {
+        out[3] = 0x01;
+        auto const ip = bound.address().to_v4().to_bytes();
+        std::copy(ip.begin(), ip.end(), &out[n]);
+        n += ip.size();
+    }
+    out[n++] = static_cast<std::uint8_t>(bound.port() >> 8);
+    out[n++] = static_cast<std::uint8_t>(bound.port() & 0xFF);
+    return n;
+}
+
+}// namespace pika::socks5
+
+#endif // SOCKS5_PARSER_HPP_
@@ -12,27 +12,61 @@ namespace pika::socks5
 
 class server
 {
-    lib::tcp::endpoint listen_ep_;
+    lib::generic::endpoint listen_ep_;
+    lib::generic_acceptor acceptor_;
     lib::tcp::resolver::results_type target_server_ep_;
+    admission & admission_;
 public:
-    server(std::string_view listen_host, boost::asio::io_context &io_context):
-        listen_ep_{util::make_connectable(listen_host, io_context)} {}
+    // Listens right away: clients may connect before run() is scheduled
+    server(std::string_view listen_host, boost::asio::io_context &io_context, admission &admit):
+        listen_ep_{util::make_endpoint(listen_host, io_context)},
+        acceptor_{util::make_listener(io_context, listen_ep_)},
+        admission_{admit} {}
 
     lib::awaitable<void> run()
     {
+        using namespace std::chrono_literals;
         auto executor = co_await lib::this_coro::executor();
         auto token    = co_await lib::this_coro::token();
 
-        lib::tcp::acceptor acceptor{executor.context(), listen_ep_};
-        std::cout << "socks5 server start listining on " << listen_ep_ << "\n";
-        for (;;)
+        lib::generic_acceptor & acceptor = acceptor_;
+        admission::gate gate{admission_};
+        std::cout << "socks5 server start listining on " << util::to_string(listen_ep_) << "\n";
+        bool back_off = false; // no co_await inside a handler
+        while (acceptor.is_open())
         {
-            lib::tcp::socket socket = co_await acceptor.async_accept(token);
+            co_await gate.wait();
+            lib::generic::socket socket{executor.context()};
+            try
+            {
+                socket = co_await acceptor.async_accept(token);
+            }
+            catch (boost::system::system_error const & e)
+            {
+                if (e.code() == boost::asio::error::operation_aborted)
+                    break;
+                // e.g. out of fds: back off instead of losing the listener
+                std::cerr << "socks5::server::run exception: " << e.what() << std::endl;
+                back_off = true;
+            }
+            if (std::exchange(back_off, false))
+            {
+                boost::asio::steady_timer t{executor.context(), 100ms};
+                co_await t.async_wait(token);
+                continue;
+            }
+            admission::ticket ticket = gate.admit();
+            if (not ticket)
+            {
+                boost::system::error_code ec;
+                socket.close(ec);
+                continue;
+            }
+
+            // start() only runs once spawned, so the lambda has to own the session until then
+            auto s = std::make_shared<session>(std::move(socket), std::move(ticket));
             lib::co_spawn(executor,
-                          [socket = std::move(socket)]() mutable
-                          {
-                              return std::make_shared<session>(std::move(socket))->start();
-                          },
+                          [s]() mutable { return s->start(); },
                           lib::detached);
         }
     }
@@ -8,23 +8,31 @@
 #include <string_view>
 #include "basic.hpp"
 #include "bridge.hpp"
+#include "socks5_parser.hpp"
 
 namespace pika::socks5
 {
 
-class session : public std::enable_shared_from_this<session>
+class session : public std::enable_shared_from_this<session>,
+                public util::counted<session>
 {
+    // the socks5 client may come over TCP or a unix socket, targets are always TCP
+    using session_bridge = basic_bridge<lib::generic::socket, lib::tcp::socket>;
+
     boost::asio::io_context &io_;
-    std::shared_ptr<bridge> bridge_;
-    lib::tcp::socket& socket_;
+    std::shared_ptr<session_bridge> bridge_;
+    lib::generic::socket& socket_;
     lib::tcp::socket& target_socket_;
 public:
-    session(lib::tcp::socket && client):
+    session(lib::generic::socket && client, admission::ticket && ticket):
         io_{client.get_executor().context()},
-        bridge_{std::make_shared<bridge>(std::move(client),
-                                         lib::tcp::socket{io_})},
+        bridge_{std::make_shared<session_bridge>(std::move(client),
+                                                 lib::tcp::socket{io_})},
         socket_{bridge_->first_socket_},
-        target_socket_{bridge_->second_socket_} {}
+        target_socket_{bridge_->second_socket_}
+    {
+        bridge_->ticket_ = std::move(ticket);
+    }
 
     lib::awaitable<void> start()
     {
@@ -34,144 +42,43 @@ public:
             auto token    = co_await lib::this_coro::token();
             auto executor = co_await lib::this_coro::executor();
 
+            // Greeting, request and early payload are parsed out of this one
+            // buffer, reading only when a message is still incomplete.
+            std::array<char, def::bufsize> buf;
+            std::size_t received = 0, parsed = 0, used = 0;
+            auto more = [&]() {
+                if (received == buf.size())
+                    throw std::runtime_error("socks5 handshake too large");
+                return socket_.async_read_some(boost::asio::buffer(buf.data() + received, buf.size() - received), token);
+            };
 
             { // socks5 handshake
-                /*
-                 +----+----------+----------+
-                 |VER | NMETHODS | METHODS  |
-                 +----+----------+----------+
-                 | 1  |    1     | 1 to 255 |
-                 +----+----------+----------+
-                 o  X'00' NO AUTHENTICATION REQUIRED
-                 o  X'01' GSSAPI
-                 o  X'02' USERNAME/PASSWORD
-                 o  X'03' to X'7F' IANA ASSIGNED
-                 o  X'80' to X'FE' RESERVED FOR PRIVATE METHODS
-                 o  X'FF' NO ACCEPTABLE METHODS
-                */
-                std::array<std::uint8_t, 2> buf; // buf contains {VER, NMETHODS}
-                std::size_t length = co_await boost::asio::async_read(socket_, boost::asio::buffer(buf), token);
-                assert(length == 2);
-
-                if (buf[0] != 0x05)
+                greeting g;
+                parse p;
+                while ((p = read_greeting({buf.data(), received}, used, g)) == parse::incomplete)
+                    received += co_await more();
+                if (p == parse::invalid)
                     throw std::runtime_error("Protocol mismatch");
+                parsed = used;
 
-                std::uint8_t num = buf[1];
-                std::vector<std::uint8_t> nmethod_buf(num);
-                length = co_await boost::asio::async_read(socket_, boost::asio::buffer(nmethod_buf), token);
-                assert(length == num);
-
-                std::array<std::uint8_t, 2> response{{0x05, 0xFF}};
-
-                for (int i = 0; i < num; i++)
-                    if (nmethod_buf.at(i) == 0x00 /* NO AUTHENTICATION REQUIRED */)
-                        response[1] = 0x00;
-
+                std::array<std::uint8_t, 2> response{{0x05, g.no_auth? std::uint8_t{0x00}: std::uint8_t{0xFF}}};
                 std::ignore = co_await boost::asio::async_write(socket_, boost::asio::buffer(response), token);
+                if (not g.no_auth)
+                    throw std::runtime_error("socks5 no acceptable method");
             } // socks5 handshake end
 
-            lib::tcp::endpoint target_endpoint;
+            request req;
             { // socks5 request
-                /* array<std::uint8_t, 4> head{VER, CMD, RSV, ATYP}
-                 +----+-----+-------+------+----------+----------+
-                 |VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
-                 +----+-----+-------+------+----------+----------+
-                 | 1  |  1  | X'00' |  1   | Variable |    2     |
-                 +----+-----+-------+------+----------+----------+
-                 o  VER    protocol version: X'05'
-                 o  CMD
-                    o  CONNECT X'01'
-                    o  BIND    X'02'
-                    o  UDP ASSOCIATE X'03'
-                 o  RSV    RESERVED
-                 o  ATYP   address type of following address
-                    o  IP V4 address: X'01'
-                    o  DOMAINNAME:    X'03'
-                    o  IP V6 address: X'04'
-                 o  DST.ADDR       desired destination address
-                 o  DST.PORT desired destination port in network octet
-                    order
-                 */
-                std::array<std::uint8_t, 4> head{}; // field {VER, CMD, RSV, ATYP}
-                std::size_t length = co_await boost::asio::async_read(socket_, boost::asio::buffer(head), token);
-                assert(length == 4);
-                enum {
-                    VER = 0,
-                    CMD,
-                    RSV,
-                    ATYP
-                };
-
-                if (head[VER] != 0x05 ||
-                    head[CMD] != 0x01 /* CONNECT */)
+                parse p;
+                while ((p = read_request({buf.data() + parsed, received - parsed}, used, req)) == parse::incomplete)
+                    received += co_await more();
+                if (p == parse::invalid)
                     throw std::runtime_error("socks5 request invalid");
-
-                int constexpr port_length = 2;
-                switch (head[ATYP])
-                {
-                    case 0x01 /* IP v4 */:
-                    {
-                        // version-4 IP address, with a length of 4 octets
-                        std::array<std::uint8_t, 4 + port_length> buf{};
-                        length = co_await boost::asio::async_read(socket_, boost::asio::buffer(buf), token);
-                        assert(length == 4 + port_length);
-                        std::uint32_t n_ip = 0;
-                        static_assert(sizeof(std::uint32_t) == 4);
-                        std::memcpy(&n_ip, buf.data(), sizeof n_ip);
-                        boost::endian::big_to_native_inplace(n_ip);
-                        boost::asio::ip::address_v4 ipv4{n_ip};
-
-                        std::uint16_t n_port = 0;
-                        std::memcpy(&n_port, buf.data() + 4, port_length);
-                        boost::endian::big_to_native_inplace(n_port);
-
-                        target_endpoint = lib::tcp::endpoint(ipv4, n_port);
-                        break;
-                    }
-                    case 0x03 /* domain name */:
-                    {
-                        // get length of domain name
-                        std::array<std::uint8_t, 1> buf{};
-                        std::ignore = co_await boost::asio::async_read(socket_, boost::asio::buffer(buf), token);
-                        int domain_name_length = buf[0];
-                        std::vector<std::uint8_t> domain(domain_name_length + port_length);
-                        length = co_await boost::asio::async_read(socket_, boost::asio::buffer(domain), token);
-                        assert(length == domain_name_length + port_length);
-
-                        std::uint16_t n_port = 0;
-                        std::memcpy(&n_port, domain.data() + domain_name_length, port_length);
-                        boost::endian::big_to_native_inplace(n_port);
-
-                        std::string domain_name;
-                        std::copy_n (domain.data(), domain_name_length, std::back_inserter(domain_name));
-
-                        lib::tcp::resolver resolver{socket_.get_executor().context()};
-                        lib::tcp::resolver::results_type r = resolver.resolve(domain_name, std::to_string(n_port));
-
-                        target_endpoint = *r;
-                        break;
-                    }
-                    case 0x04 /* IP v6 */:
-                    {
-                        // version-4 IP address, with a length of 16 octets
-                        std::array<std::uint8_t, 16 + port_length> buf{};
-                        std::cerr << "IP v6 not impl\n";
-                        [[fallthrough]];
-                    }
-                    default:
-                        throw std::runtime_error("ATYP not supported");
-                }
-                std::cout << "socks5 session #" << self->id() << " started with target endpoint: " << target_endpoint << "\n";
+                parsed += used;
             } // socks5 request end
 
             { // response of socks5 request
                 /*
-                 +----+-----+-------+------+----------+----------+
-                 |VER | REP |  RSV  | ATYP | BND.ADDR | BND.PORT |
-                 +----+-----+-------+------+----------+----------+
-                 | 1  |  1  | X'00' |  1   | Variable |    2     |
-                 +----+-----+-------+------+----------+----------+
-                   o  VER    protocol version: X'05'
                    o  REP    Reply field:
                       o  X'00' succeeded
                       o  X'01' general SOCKS server failure
@@ -183,54 +90,50 @@ public:
                       o  X'07' Command not supported
                       o  X'08' Address type not supported
                       o  X'09' to X'FF' unassigned
-                   o  RSV    RESERVED
-                   o  ATYP   address type of following address
-                      o  IP V4 address: X'01'
-                      o  DOMAINNAME:    X'03'
-                      o  IP V6 address: X'04'
-                   o  BND.ADDR       server bound address
-                   o  BND.PORT       server bound port in network octet order
                  */
-                std::array<std::uint8_t,
-                           4 /* header */ +
-                           4 /* ipv4 */ +
-                           2 /* port */> response{{
-                    0x05, // VER
-                    0x00, // REP
-                    0x00, // RSV
-                    0x01, // ATYP == ipv4
-                }};
-                try
-                {
-                    co_await target_socket_.async_connect(target_endpoint, token);
-
-                    std::uint32_t ip = target_socket_.remote_endpoint().address().to_v4().to_ulong();
-                    boost::endian::native_to_big_inplace(ip);
-                    std::uint16_t port = target_socket_.remote_endpoint().port();
-                    boost::endian::native_to_big_inplace(port);
-
-                    std::memcpy(&response[4], &ip,   sizeof ip);
-                    std::memcpy(&response[8], &port, sizeof port);
-                }
-                catch (boost::system::system_error const & e)
+                reply_buffer response;
+                std::uint8_t rep = req.reply;
+                if (rep == 0x00)
                 {
-                    switch (e.code().value())
+                    try
                     {
-                        case boost::asio::error::network_unreachable: response[1] = 0x03; break;
-                        case boost::asio::error::host_unreachable:    response[1] = 0x04; break;
-                        case boost::asio::error::connection_refused:  response[1] = 0x05; break;
-                        case boost::asio::error::timed_out:           response[1] = 0x06; break;
-                        default: response[1] = 0x01; break;
+                        if (req.domain.empty())
+                            co_await target_socket_.async_connect(req.endpoint, token);
+                        else
+                        {
+                            lib::tcp::resolver resolver{io_};
+                            auto const targets = co_await resolver.async_resolve(std::string{req.domain},
+                                                                                 std::to_string(req.port), token);
+                            std::ignore = co_await boost::asio::async_connect(target_socket_, targets, token);
+                        }
                     }
-                    std::ignore = co_await boost::asio::async_write(socket_, boost::asio::buffer(response), token);
+                    catch (boost::system::system_error const & e)
+                    {
+                        boost::system::error_code const ec = e.code();
+                        if      (ec == boost::asio::error::network_unreachable) rep = 0x03;
+                        else if (ec == boost::asio::error::host_unreachable ||
+                                 ec == boost::asio::error::host_not_found)      rep = 0x04;
+                        else if (ec == boost::asio::error::connection_refused)  rep = 0x05;
+                        else if (ec == boost::asio::error::timed_out)           rep = 0x06;
+                        else                                                    rep = 0x01;
+                    }
+                }
 
-                    using namespace std::literals;
-                    throw std::runtime_error("Bad target endpoint, error: "s + e.what());
-                    co_return;
+                if (rep != 0x00)
+                {
+                    std::ignore = co_await boost::asio::async_write(socket_, boost::asio::buffer(response, make_reply(response, rep)), token);
+                    throw std::runtime_error("socks5 request refused, REP " + std::to_string(rep));
                 }
-                std::ignore = co_await boost::asio::async_write(socket_, boost::asio::buffer(response), token);
+
+                lib::tcp::endpoint const target_endpoint = target_socket_.remote_endpoint();
+                std::cout << "socks5 session #" << self->id() << " started with target endpoint: " << target_endpoint << "\n";
+                std::ignore = co_await boost::asio::async_write(socket_, boost::asio::buffer(response, make_reply(response, 0x00, target_endpoint)), token);
             } // response of socks5 request end
 
+            // payload the client sent along with its request
+            if (parsed < received)
+                std::ignore = co_await boost::asio::async_write(target_socket_, boost::asio::buffer(buf.data() + parsed, received - parsed), token);
+
             co_await self->bridge_->start_transport();
         }
         catch (std::exception const & e)
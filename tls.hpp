@@ -0,0 +1,519 @@
+#ifndef TLS_HPP_
+#define TLS_HPP_
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio/ssl.hpp>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include "basic.hpp"
+
+#if __has_include(<linux/tls.h>)
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#define PIKA_HAS_KTLS 1
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
+namespace pika::tls
+{
+
+struct options
+{
+    std::string cert; // certificate chain, required on the controller
+    std::string key;
+    std::string ca;   // client: verify the controller; controller: require client certificates
+    bool ktls {true};
+};
+
+namespace detail
+{
+
+// TLS 1.3 application traffic secrets, captured through the keylog callback
+struct traffic_secrets
+{
+    std::vector<std::uint8_t> client;
+    std::vector<std::uint8_t> server;
+};
+
+inline
+int secrets_index()
+{
+    static int const index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+inline
+std::vector<std::uint8_t> unhex(std::string_view hex)
+{
+    auto value = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+
+    std::vector<std::uint8_t> out;
+    for (std::size_t i = 0; i + 1 < hex.size(); i += 2)
+    {
+        int const hi = value(hex[i]), lo = value(hex[i + 1]);
+        if (hi < 0 || lo < 0)
+            return {};
+        out.push_back(static_cast<std::uint8_t>(hi << 4 | lo));
+    }
+    return out;
+}
+
+inline
+void keylog(SSL const * ssl, char const * line)
+{
+    auto * secrets = static_cast<traffic_secrets *>(SSL_get_ex_data(ssl, secrets_index()));
+    if (not secrets)
+        return;
+
+    // "<LABEL> <client random> <secret>"
+    std::string_view const l{line};
+    auto capture = [&l](std::string_view label, std::vector<std::uint8_t> & out) {
+        if (l.size() > label.size() && l.substr(0, label.size()) == label && l[label.size()] == ' ')
+            out = unhex(l.substr(l.rfind(' ') + 1));
+    };
+    capture("CLIENT_TRAFFIC_SECRET_0", secrets->client);
+    capture("SERVER_TRAFFIC_SECRET_0", secrets->server);
+}
+
+// HKDF-Expand-Label from RFC 8446 section 7.1, with an empty context
+inline
+std::vector<std::uint8_t> expand_label(EVP_MD const * md, std::vector<std::uint8_t> const & secret,
+                                       std::string_view label, std::size_t length)
+{
+    using namespace std::literals;
+    std::string const full_label = "tls13 "s + std::string{label};
+    std::vector<std::uint8_t> info{static_cast<std::uint8_t>(length >> 8),
+                                   static_cast<std::uint8_t>(length & 0xFF),
+                                   static_cast<std::uint8_t>(full_label.size())};
+    info.insert(info.end(), full_label.begin(), full_label.end());
+    info.push_back(0x00);
+
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> pctx{EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr),
+                                                                    &EVP_PKEY_CTX_free};
+    std::vector<std::uint8_t> out(length);
+    std::size_t out_length = length;
+    if (not pctx ||
+        EVP_PKEY_derive_init(pctx.get()) <= 0 ||
+        EVP_PKEY_CTX_hkdf_mode(pctx.get(), EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) <= 0 ||
+        EVP_PKEY_CTX_set_hkdf_md(pctx.get(), md) <= 0 ||
+        EVP_PKEY_CTX_set1_hkdf_key(pctx.get(), secret.data(), secret.size()) <= 0 ||
+        EVP_PKEY_CTX_add1_hkdf_info(pctx.get(), info.data(), info.size()) <= 0 ||
+        EVP_PKEY_derive(pctx.get(), out.data(), &out_length) <= 0 ||
+        out_length != length)
+        return {};
+    return out;
+}
+
+#ifdef PIKA_HAS_KTLS
+template <typename CryptoInfo>
+bool install_key(int fd, int direction, int cipher_type, EVP_MD const * md, std::vector<std::uint8_t> const & secret)
+{
+    CryptoInfo info{};
+    std::vector<std::uint8_t> key = expand_label(md, secret, "key", sizeof info.key);
+    std::vector<std::uint8_t> iv  = expand_label(md, secret, "iv",  sizeof info.salt + sizeof info.iv);
+    if (key.empty() || iv.empty())
+        return false;
+
+    info.info.version     = TLS_1_3_VERSION;
+    info.info.cipher_type = cipher_type;
+    std::memcpy(info.key,  key.data(), sizeof info.key);
+    std::memcpy(info.salt, iv.data(),  sizeof info.salt);
+    std::memcpy(info.iv,   iv.data() + sizeof info.salt, sizeof info.iv);
+    // rec_seq stays zero: no record has used the application traffic keys yet
+    return ::setsockopt(fd, SOL_TLS, direction, &info, sizeof info) == 0;
+}
+
+template <typename CryptoInfo>
+bool install_keys(int fd, int cipher_type, EVP_MD const * md,
+                  std::vector<std::uint8_t> const & rx, std::vector<std::uint8_t> const & tx)
+{
+    if (not install_key<CryptoInfo>(fd, TLS_RX, cipher_type, md, rx))
+        return false; // only the pass-through ULP is attached, userspace TLS still works
+
+    if (not install_key<CryptoInfo>(fd, TLS_TX, cipher_type, md, tx))
+        throw std::runtime_error("kTLS: receive key installed but transmit key refused");
+    return true;
+}
+#endif // PIKA_HAS_KTLS
+
+// Hands record encryption of a freshly handshaked connection to the kernel.
+// Returns false when the connection must stay on userspace TLS.
+inline
+bool offload([[maybe_unused]] int fd, [[maybe_unused]] SSL * ssl,
+             [[maybe_unused]] bool is_client, [[maybe_unused]] traffic_secrets const & secrets)
+{
+#ifdef PIKA_HAS_KTLS
+    if (SSL_version(ssl) != TLS1_3_VERSION || secrets.client.empty() || secrets.server.empty())
+        return false;
+
+    // records already pulled into the userspace engine cannot be given back to the kernel;
+    // record_socket kept asio from reading past the last handshake record
+    if (SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0)
+        return false;
+
+    // fails on unix domain sockets, which stay on userspace TLS
+    if (::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof "tls") != 0)
+        return false;
+
+    auto const & rx = is_client ? secrets.server : secrets.client;
+    auto const & tx = is_client ? secrets.client : secrets.server;
+    switch (SSL_CIPHER_get_id(SSL_get_current_cipher(ssl)))
+    {
+        case TLS1_3_CK_AES_128_GCM_SHA256:
+            return install_keys<tls12_crypto_info_aes_gcm_128>(fd, TLS_CIPHER_AES_GCM_128, EVP_sha256(), rx, tx);
+        case TLS1_3_CK_AES_256_GCM_SHA384:
+            return install_keys<tls12_crypto_info_aes_gcm_256>(fd, TLS_CIPHER_AES_GCM_256, EVP_sha384(), rx, tx);
+        default:
+            return false;
+    }
+#else
+    return false;
+#endif
+}
+
+// Next layer of the userspace TLS engine. Until the handshake is over it
+// reads one TLS record at a time: asio keeps whatever it read past the
+// engine's needs in an input buffer of its own, where kTLS cannot get it back.
+class record_socket
+{
+    lib::generic::socket socket_;
+    std::array<std::uint8_t, 5> header_ {};
+    std::size_t header_size_ {0}; // header bytes of the current record read so far
+    std::size_t body_left_ {0};
+    bool exact_ {true};
+
+    void consumed(std::uint8_t const * data, std::size_t n)
+    {
+        while (n)
+        {
+            std::size_t take;
+            if (header_size_ < header_.size())
+            {
+                take = std::min(n, header_.size() - header_size_);
+                std::memcpy(header_.data() + header_size_, data, take);
+                header_size_ += take;
+                if (header_size_ == header_.size())
+                    body_left_ = std::size_t{header_[3]} << 8 | header_[4];
+            }
+            else
+            {
+                take = std::min(n, body_left_);
+                body_left_ -= take;
+            }
+            data += take;
+            n    -= take;
+            if (header_size_ == header_.size() && body_left_ == 0)
+                header_size_ = 0;
+        }
+    }
+
+public:
+    using executor_type     = lib::generic::socket::executor_type;
+    using lowest_layer_type = lib::generic::socket::lowest_layer_type;
+
+    explicit record_socket(lib::generic::socket && s): socket_{std::move(s)} {}
+
+    executor_type get_executor() { return socket_.get_executor(); }
+    lowest_layer_type & lowest_layer() { return socket_.lowest_layer(); }
+    lowest_layer_type const & lowest_layer() const { return socket_.lowest_layer(); }
+    lib::generic::socket & socket() { return socket_; }
+
+    // The connection stays on userspace TLS: read whatever arrived
+    void read_freely() { exact_ = false; }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(MutableBufferSequence const & buffers, ReadHandler && handler)
+    {
+        boost::asio::mutable_buffer const b = *boost::asio::buffer_sequence_begin(buffers);
+        if (not exact_ || b.size() == 0)
+        {
+            socket_.async_read_some(buffers, std::forward<ReadHandler>(handler));
+            return;
+        }
+        std::size_t const limit = header_size_ < header_.size()? header_.size() - header_size_: body_left_;
+        boost::asio::mutable_buffer const part = boost::asio::buffer(b, limit);
+        socket_.async_read_some(part, [this, part, handler = std::forward<ReadHandler>(handler)]
+                                      (boost::system::error_code const & ec, std::size_t n) mutable {
+            consumed(static_cast<std::uint8_t const *>(part.data()), n);
+            handler(ec, n);
+        });
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    void async_write_some(ConstBufferSequence const & buffers, WriteHandler && handler)
+    {
+        socket_.async_write_some(buffers, std::forward<WriteHandler>(handler));
+    }
+};
+
+}// namespace detail
+
+class context
+{
+    boost::asio::ssl::context ctx_;
+    bool ktls_;
+public:
+    enum class role { controller, client };
+
+    context(options const & o, role r):
+        ctx_{boost::asio::ssl::context::tls},
+#ifdef PIKA_HAS_KTLS
+        ktls_{o.ktls}
+#else
+        ktls_{false}
+#endif
+    {
+        // kTLS keys are derived from TLS 1.3 traffic secrets, and both ends are ours anyway
+        SSL_CTX_set_min_proto_version(ctx_.native_handle(), TLS1_3_VERSION);
+        if (ktls_)
+            SSL_CTX_set_keylog_callback(ctx_.native_handle(), &detail::keylog);
+
+        if (r == role::controller)
+        {
+            ctx_.use_certificate_chain_file(o.cert);
+            ctx_.use_private_key_file(o.key.empty()? o.cert: o.key, boost::asio::ssl::context::pem);
+            // session tickets would be encrypted records arriving after the handshake
+            SSL_CTX_set_num_tickets(ctx_.native_handle(), 0);
+            if (not o.ca.empty())
+            {
+                ctx_.load_verify_file(o.ca);
+                ctx_.set_verify_mode(boost::asio::ssl::verify_peer |
+                                     boost::asio::ssl::verify_fail_if_no_peer_cert);
+            }
+        }
+        else
+        {
+            ctx_.load_verify_file(o.ca);
+            ctx_.set_verify_mode(boost::asio::ssl::verify_peer);
+            if (not o.cert.empty())
+            {
+                ctx_.use_certificate_chain_file(o.cert);
+                ctx_.use_private_key_file(o.key.empty()? o.cert: o.key, boost::asio::ssl::context::pem);
+            }
+        }
+    }
+
+    boost::asio::ssl::context & native() { return ctx_; }
+    bool ktls() const { return ktls_; }
+};
+
+// The name a client verifies the controller's certificate against and sends
+// as SNI. A unix socket has none, only the certificate chain is verified;
+// a port without a host ("":7000") cannot be verified at all.
+inline
+std::string server_name(std::string_view controller_host)
+{
+    if (util::is_local(controller_host))
+        return {};
+    std::string name {controller_host.substr(0, controller_host.find(':'))};
+    if (name.empty())
+        throw std::invalid_argument("TLS needs the controller's host name to verify it, got " + std::string{controller_host});
+    return name;
+}
+
+// A control or data connection to the peer: plaintext, kernel TLS or userspace TLS,
+// over TCP or a unix domain socket. With plaintext and kTLS all I/O goes straight
+// to the socket, so relaying stays plain socket reads and writes.
+class stream
+{
+    using ssl_stream = boost::asio::ssl::stream<detail::record_socket>;
+
+    lib::generic::socket socket_;
+    std::unique_ptr<ssl_stream> ssl_;
+    std::deque<std::array<std::uint8_t, 8>> outbox_;
+    bool writing_ {false};
+    std::uint64_t queued_ {0};          // frames ever queued
+    std::uint64_t sent_   {0};          // of those, written to the socket
+    boost::system::error_code failed_;  // the write that broke the connection
+    boost::asio::steady_timer progress_; // cancelled whenever sent_ moves, the writer stops or a hold ends
+    bool held_ {false};
+    bool offloaded_ {false};
+
+public:
+    using executor_type     = lib::generic::socket::executor_type;
+    using lowest_layer_type = lib::generic::socket::lowest_layer_type;
+
+    // `offloaded`: the socket already carries kTLS state, e.g. one handed over by an upgrade
+    explicit stream(lib::generic::socket && s, bool offloaded = false):
+        socket_{std::move(s)},
+        progress_{socket_.get_executor().context(), std::chrono::steady_clock::time_point::max()},
+        offloaded_{offloaded} {}
+
+    executor_type       get_executor() { return lowest_layer().get_executor(); }
+    lowest_layer_type & lowest_layer() { return ssl_? ssl_->lowest_layer(): socket_.lowest_layer(); }
+
+    char const * mode() const { return ssl_? "userspace tls": offloaded_? "ktls": "plaintext"; }
+    bool offloaded() const { return offloaded_; }
+    // The kernel holds all of the connection's state, another process can take the socket over
+    bool movable() const { return not ssl_; }
+
+    lib::awaitable<void> handshake(context & ctx, boost::asio::ssl::stream_base::handshake_type type,
+                                   std::string const & host = {})
+    {
+        auto token = co_await lib::this_coro::token();
+
+        ssl_ = std::make_unique<ssl_stream>(std::move(socket_), ctx.native());
+        SSL * ssl = ssl_->native_handle();
+        if (not ctx.ktls())
+            ssl_->next_layer().read_freely();
+
+        detail::traffic_secrets secrets;
+        SSL_set_ex_data(ssl, detail::secrets_index(), &secrets);
+        BOOST_SCOPE_EXIT (ssl) {
+            SSL_set_ex_data(ssl, detail::secrets_index(), nullptr);
+        } BOOST_SCOPE_EXIT_END;
+
+        if (not host.empty())
+        {
+            SSL_set_tlsext_host_name(ssl, host.c_str());
+            ssl_->set_verify_callback(boost::asio::ssl::rfc2818_verification{host});
+        }
+
+        co_await ssl_->async_handshake(type, token);
+
+        bool const is_client = type == boost::asio::ssl::stream_base::client;
+        if (ctx.ktls() && detail::offload(ssl_->next_layer().socket().native_handle(), ssl, is_client, secrets))
+        {
+            // the SSL object is dropped without a close_notify, the kernel owns the records now
+            socket_    = std::move(ssl_->next_layer().socket());
+            offloaded_ = true;
+            ssl_.reset();
+        }
+        else
+            ssl_->next_layer().read_freely();
+    }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    auto async_read_some(MutableBufferSequence const & buffers, ReadHandler && handler)
+    {
+        if (ssl_)
+            return ssl_->async_read_some(buffers, std::forward<ReadHandler>(handler));
+        return socket_.async_read_some(buffers, std::forward<ReadHandler>(handler));
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    auto async_write_some(ConstBufferSequence const & buffers, WriteHandler && handler)
+    {
+        if (ssl_)
+            return ssl_->async_write_some(buffers, std::forward<WriteHandler>(handler));
+        return socket_.async_write_some(buffers, std::forward<WriteHandler>(handler));
+    }
+
+    // Parks whoever writes a frame from now on until release(), e.g. while
+    // the connection moves to another process. Frames queued before still
+    // go out, idle() tells when they did.
+    void hold() { held_ = true; }
+
+    // Lets the parked writers go on, or fail with `ec`
+    void release(boost::system::error_code ec = {})
+    {
+        held_ = false;
+        if (ec)
+            failed_ = ec;
+        progress_.cancel();
+    }
+
+    bool idle() const { return not writing_ && outbox_.empty(); }
+
+    // Returns once the stream is not held, throws if it broke meanwhile
+    lib::awaitable<void> released()
+    {
+        auto token = co_await lib::this_coro::token();
+        while (held_)
+        {
+            try
+            {
+                co_await progress_.async_wait(token);
+            }
+            catch (boost::system::system_error const &) {} // woken by release() or a writer
+        }
+        if (failed_)
+            throw boost::system::system_error{failed_};
+    }
+
+    // Userspace TLS allows a single outstanding write, so control frames
+    // from concurrent coroutines are queued and written in order. Returns
+    // once the frame is in the socket, also when another writer wrote it,
+    // and throws when the connection broke first.
+    lib::awaitable<void> write_frame(std::array<std::uint8_t, 8> const & frame)
+    {
+        co_await released();
+        outbox_.push_back(frame);
+        co_await flush(++queued_);
+    }
+
+    // Frames of one message, never interleaved with frames of other writers
+    lib::awaitable<void> write_frames(std::vector<std::array<std::uint8_t, 8>> const & frames)
+    {
+        co_await released();
+        outbox_.insert(outbox_.end(), frames.begin(), frames.end());
+        queued_ += frames.size();
+        co_await flush(queued_);
+    }
+
+private:
+    // Writes the outbox unless another writer is at it, then waits for that
+    // one to get past frame number `upto`
+    lib::awaitable<void> flush(std::uint64_t upto)
+    {
+        auto token = co_await lib::this_coro::token();
+        while (writing_ && sent_ < upto)
+        {
+            try
+            {
+                co_await progress_.async_wait(token);
+            }
+            catch (boost::system::system_error const &) {} // woken by the writer
+        }
+        if (failed_)
+            throw boost::system::system_error{failed_};
+        if (sent_ >= upto)
+            co_return;
+
+        writing_ = true;
+        stream * self = this;
+        BOOST_SCOPE_EXIT (self) {
+            self->writing_ = false;
+            self->progress_.cancel();
+        } BOOST_SCOPE_EXIT_END;
+
+        try
+        {
+            while (not outbox_.empty())
+            {
+                std::array<std::uint8_t, 8> const next = outbox_.front();
+                outbox_.pop_front();
+                std::ignore = co_await boost::asio::async_write(*this, boost::asio::buffer(next), token);
+                sent_++;
+                progress_.cancel();
+            }
+        }
+        catch (boost::system::system_error const & e)
+        {
+            failed_ = e.code();
+            throw;
+        }
+    }
+};
+
+}// namespace pika::tls
+
+#endif // TLS_HPP_
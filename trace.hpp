@@ -0,0 +1,366 @@
+#ifndef TRACE_HPP_
+#define TRACE_HPP_
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <vector>
+#include "basic.hpp"
+
+namespace pika::trace
+{
+
+// Lifecycle of one public connection. The controller samples it and
+// flags the 0x02 notice, so the client traces the same connection id.
+enum class stage : std::uint8_t
+{
+    accepted,           // controller: public connection accepted
+    notice_sent,        // controller: 0x02 notice written to the client
+    notice_received,    // client: 0x02 notice read
+    export_connected,   // client: connected to the exported service
+    export_failed,      // client: the exported service refused, instead of export_connected
+    dialback_connected, // client: connected back to the controller
+    lookup,             // controller: dial-back matched in clients
+    first_byte,         // both: first byte relayed by the bridge
+};
+
+constexpr std::array<char const *, 8> stage_names {
+    "accepted", "notice_sent", "notice_received", "export_connected",
+    "export_failed", "dialback_connected", "lookup", "first_byte"
+};
+
+inline
+std::optional<stage> parse_stage(std::string_view name)
+{
+    for (std::size_t i = 0; i < stage_names.size(); i++)
+        if (name == stage_names[i])
+            return static_cast<stage>(i);
+    return std::nullopt;
+}
+
+inline
+std::int64_t now()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+class collector;
+
+// Emitted as one line when the last owner lets go of it:
+// "<side> <id> <stage>=<monotonic ns> ..."
+class span
+{
+    std::shared_ptr<collector> owner_;
+    std::uint32_t id_;
+    char const * side_;
+    std::vector<std::pair<stage, std::int64_t>> marks_;
+public:
+    span(std::shared_ptr<collector> owner, std::uint32_t id, char const * side):
+        owner_{std::move(owner)}, id_{id}, side_{side} {}
+    span(span const &) = delete;
+    span& operator = (span const &) = delete;
+    ~span();
+
+    void mark(stage s) { marks_.emplace_back(s, now()); }
+};
+
+class collector : public std::enable_shared_from_this<collector>
+{
+    struct subscriber
+    {
+        lib::tcp::socket socket;
+        std::deque<std::string> lines;
+        std::size_t dropped {0};
+        bool writing {false};
+    };
+
+    static constexpr std::size_t max_backlog {4096}; // lines queued per admin reader
+
+    boost::asio::io_context &io_;
+    double rate_;
+    std::ofstream file_;
+    boost::asio::steady_timer flush_timer_;
+    bool flush_pending_ {false};
+    std::list<std::shared_ptr<subscriber>> subscribers_;
+    std::minstd_rand rng_{std::random_device{}()};
+    std::uniform_real_distribution<double> dice_{0.0, 1.0};
+
+public:
+    collector(boost::asio::io_context &io_context, double rate, std::string const & file):
+        io_{io_context},
+        rate_{rate},
+        flush_timer_{io_context}
+    {
+        if (not file.empty())
+        {
+            file_.open(file, std::ios::app);
+            if (not file_)
+                throw std::runtime_error("cannot open trace file " + file);
+        }
+    }
+
+    // A new span for `rate` of the calls, nullptr otherwise
+    std::shared_ptr<span> sample(std::uint32_t id, char const * side)
+    {
+        if (rate_ <= 0 || dice_(rng_) >= rate_)
+            return nullptr;
+        return follow(id, side);
+    }
+
+    // A span for a connection the peer already sampled
+    std::shared_ptr<span> follow(std::uint32_t id, char const * side)
+    {
+        return std::make_shared<span>(shared_from_this(), id, side);
+    }
+
+    void emit(std::string const & line)
+    {
+        if (file_)
+        {
+            // flushed once a second instead of once per span
+            file_ << line << '\n';
+            if (not std::exchange(flush_pending_, true))
+            {
+                flush_timer_.expires_after(std::chrono::seconds{1});
+                flush_timer_.async_wait([self = shared_from_this()](boost::system::error_code const &) {
+                    self->flush_pending_ = false;
+                    self->file_.flush();
+                });
+            }
+        }
+
+        for (auto & sub : subscribers_)
+        {
+            // a reader that cannot keep up loses spans, not our memory
+            if (sub->lines.size() >= max_backlog)
+            {
+                sub->dropped++;
+                continue;
+            }
+            if (sub->dropped)
+                sub->lines.push_back("# " + std::to_string(std::exchange(sub->dropped, 0)) + " spans dropped");
+            sub->lines.push_back(line);
+            if (not std::exchange(sub->writing, true))
+                lib::co_spawn(io_,
+                              [self = shared_from_this(), sub]() mutable {
+                                  return self->drain(sub);
+                              }, lib::detached);
+        }
+    }
+
+    // Streams every emitted span to whoever connects to the admin socket
+    lib::awaitable<void> serve(lib::tcp::endpoint admin_ep)
+    {
+        auto executor = co_await lib::this_coro::executor();
+        auto token    = co_await lib::this_coro::token();
+
+        lib::tcp::acceptor acceptor{executor.context(), admin_ep};
+        std::cout << "trace admin socket listening on " << admin_ep << "\n";
+        for (;;)
+        {
+            lib::tcp::socket socket = co_await acceptor.async_accept(token);
+            subscribers_.push_back(std::make_shared<subscriber>(subscriber{std::move(socket)}));
+        }
+    }
+
+private:
+    lib::awaitable<void> drain(std::shared_ptr<subscriber> sub)
+    {
+        auto token = co_await lib::this_coro::token();
+        try
+        {
+            while (not sub->lines.empty())
+            {
+                std::string const line = std::move(sub->lines.front()) + "\n";
+                sub->lines.pop_front();
+                std::ignore = co_await boost::asio::async_write(sub->socket, boost::asio::buffer(line), token);
+            }
+            sub->writing = false;
+        }
+        catch (std::exception const &)
+        {
+            subscribers_.remove(sub);
+        }
+    }
+};
+
+inline
+span::~span()
+{
+    if (marks_.empty())
+        return;
+
+    std::ostringstream line;
+    line << side_ << " " << id_;
+    for (auto const & [s, t] : marks_)
+        line << " " << stage_names.at(static_cast<std::size_t>(s)) << "=" << t;
+    owner_->emit(line.str());
+}
+
+// One emitted span line, parsed back
+struct record
+{
+    std::string side;
+    std::uint32_t id;
+    std::map<stage, std::int64_t> marks;
+};
+
+// Nothing for a line that is not a span, e.g. cut short or a comment
+inline
+std::optional<record> parse(std::string const & text)
+{
+    std::istringstream line{text};
+    record r;
+    if (not (line >> r.side >> r.id))
+        return std::nullopt;
+
+    std::string field;
+    while (line >> field)
+    {
+        auto const eq = field.find('=');
+        if (eq == std::string::npos)
+            return std::nullopt;
+        std::optional<stage> s = parse_stage(std::string_view{field}.substr(0, eq));
+        std::int64_t t = 0;
+        char const * const last = field.data() + field.size();
+        auto const [end, ec] = std::from_chars(field.data() + eq + 1, last, t);
+        if (ec != std::errc{} || end != last)
+            return std::nullopt;
+        if (s) // stages of newer builds are skipped
+            r.marks.emplace(*s, t);
+    }
+    return r;
+}
+
+// The controller's and the client's span of one connection on the
+// controller's clock. Both sides share the monotonic clock on one host;
+// otherwise the client's clock is shifted by the offset the notice and
+// the dial-back imply, like NTP does, which splits their round trip evenly.
+// A stage is marked once its write completed, so on one host a hop may
+// come out slightly negative; clocks further apart than that are aligned.
+inline
+std::optional<std::map<stage, std::int64_t>> join(record const & controller, record const & client, bool & aligned)
+{
+    auto at = [](record const & r, stage s) -> std::optional<std::int64_t> {
+        auto it = r.marks.find(s);
+        return it == r.marks.end()? std::nullopt: std::optional<std::int64_t>{it->second};
+    };
+    auto const sent = at(controller, stage::notice_sent), lookup = at(controller, stage::lookup);
+    auto const received = at(client, stage::notice_received), dialed = at(client, stage::dialback_connected);
+    if (not sent || not lookup || not received || not dialed)
+        return std::nullopt;
+
+    constexpr std::int64_t slack {1'000'000}; // ns
+    std::int64_t offset = 0;
+    aligned = *received - *sent < -slack || *lookup - *dialed < -slack;
+    if (aligned)
+        offset = ((*received - *sent) + (*dialed - *lookup)) / 2;
+
+    std::map<stage, std::int64_t> marks = controller.marks; // first_byte: the controller's
+    for (auto const & [s, t] : client.marks)
+        marks.emplace(s, t - offset);
+    return marks;
+}
+
+// Stage-to-stage latency percentiles from emitted span lines: per side, and
+// across both processes for connections traced on both (joined by id).
+inline
+void summarize(std::istream & in, std::ostream & out)
+{
+    using step = std::pair<stage, stage>;
+    std::map<std::string, std::map<step, std::vector<std::int64_t>>> steps;
+    std::map<std::string, std::vector<std::int64_t>> totals;
+    std::map<std::uint32_t, std::deque<record>> controllers, clients;
+    std::size_t skipped = 0;
+
+    // consecutive stages in lifecycle order
+    auto add = [&](std::string const & section, std::map<stage, std::int64_t> const & marks) {
+        if (marks.size() < 2)
+            return;
+        for (auto prev = marks.begin(), it = std::next(prev); it != marks.end(); prev = it++)
+            steps[section][{prev->first, it->first}].push_back(it->second - prev->second);
+        totals[section].push_back(marks.rbegin()->second - marks.begin()->second);
+    };
+
+    std::string text;
+    while (std::getline(in, text))
+    {
+        std::optional<record> r = parse(text);
+        if (not r)
+        {
+            skipped += not text.empty() && text[0] != '#';
+            continue;
+        }
+        add(r->side, r->marks);
+        if (r->side == "controller")
+            controllers[r->id].push_back(std::move(*r));
+        else if (r->side == "client")
+            clients[r->id].push_back(std::move(*r));
+    }
+
+    // a connection id names the public peer address, so it comes back
+    // with a reused port; each side emits the spans of an id in order
+    std::size_t joined = 0, aligned = 0;
+    for (auto & [id, sides] : controllers)
+    {
+        std::deque<record> & other = clients[id];
+        for (; not sides.empty() && not other.empty(); sides.pop_front(), other.pop_front())
+        {
+            bool shifted = false;
+            if (auto marks = join(sides.front(), other.front(), shifted))
+            {
+                add("connection", *marks);
+                joined++;
+                aligned += shifted;
+            }
+        }
+    }
+
+    auto percentile = [](std::vector<std::int64_t> const & sorted, double p) {
+        std::size_t const rank = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+        return sorted.at(rank) / 1000.0;
+    };
+    auto row = [&](std::string const & label, std::vector<std::int64_t> & samples) {
+        std::sort(samples.begin(), samples.end());
+        out << "  " << std::left << std::setw(42) << label << std::right
+            << std::setw(8)  << samples.size()
+            << std::setw(12) << percentile(samples, 0.50)
+            << std::setw(12) << percentile(samples, 0.90)
+            << std::setw(12) << percentile(samples, 0.99)
+            << std::setw(12) << samples.back() / 1000.0 << "\n";
+    };
+
+    out << std::fixed << std::setprecision(1);
+    for (auto & [section, by_step] : steps)
+    {
+        out << section << " (microseconds)";
+        if (section == "connection")
+            out << ", " << joined << " joined by id, " << aligned << " with the client clock aligned by round trip";
+        out << "\n"
+            << "  " << std::left << std::setw(42) << "stage" << std::right
+            << std::setw(8) << "count" << std::setw(12) << "p50" << std::setw(12) << "p90"
+            << std::setw(12) << "p99"  << std::setw(12) << "max" << "\n";
+        for (auto & [st, samples] : by_step)
+            row(std::string{stage_names.at(static_cast<std::size_t>(st.first))} + " -> " +
+                stage_names.at(static_cast<std::size_t>(st.second)), samples);
+        if (not totals[section].empty())
+            row("total", totals[section]);
+    }
+    if (skipped)
+        out << skipped << " malformed lines skipped\n";
+}
+
+}// namespace pika::trace
+
+#endif // TRACE_HPP_
@@ -0,0 +1,364 @@
+#ifndef UPGRADE_HPP_
+#define UPGRADE_HPP_
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+#include "basic.hpp"
+#include "bridge.hpp"
+
+extern char **environ;
+
+namespace pika::upgrade
+{
+
+// Zero-downtime upgrade: the running server execs its binary again and
+// passes its listening sockets over a unix socket pair (SCM_RIGHTS). The
+// listen queues never close, so public ports keep accepting throughout;
+// the old process only lets its bridges finish.
+constexpr char const * channel_env {"REVERSE_TUNNEL_UPGRADE_FD"};
+constexpr std::chrono::seconds take_over_timeout {10}; // for the new process to start, and then to adopt the sockets
+constexpr char started_signal {2}; // the new process is up
+constexpr char taken_signal   {1}; // and adopted the sockets
+constexpr std::chrono::seconds claim_window {60};      // for a client to bind a handed over public listener again
+
+// One socket handed over, one SOCK_SEQPACKET message each
+struct item
+{
+    enum class kind : std::uint8_t
+    {
+        listener, // control listener
+        routed,   // routed public listener
+        acceptor, // public listener of a bound tunnel
+        control,  // control connection of a tunnel
+        pending,  // public connection waiting for its dial-back
+        done
+    };
+
+    kind          what   {kind::done};
+    std::uint8_t  flags  {0}; // control: kTLS offloaded
+    std::uint32_t tunnel {0}; // ties a tunnel's acceptor, control and pending connections together, 0 for none
+    std::uint32_t value  {0}; // listener: socket protocol, control: bridge cap, pending: connection id
+    std::string   data;       // listener: endpoint bytes, control: route name
+    int           fd     {-1};
+};
+
+constexpr std::size_t header_size {12};
+constexpr std::size_t max_message {header_size + 512};
+
+struct child
+{
+    pid_t pid;
+    int   channel; // our end of the socket pair
+};
+
+[[noreturn]] inline
+void fail(char const * what)
+{
+    throw boost::system::system_error{boost::system::error_code{errno, boost::system::system_category()}, what};
+}
+
+// Execs argv again with the other end of a socket pair as fd 3. Everything
+// else but stdio is closed first, the new process gets its sockets from us.
+inline
+child spawn(char * const argv[])
+{
+    int pair[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0)
+        fail("upgrade socketpair");
+
+    // everything the child needs is prepared before the fork
+    std::string const assignment = std::string{channel_env} + "=3";
+    std::vector<char *> env;
+    for (char ** e = environ; *e; e++)
+        if (std::strncmp(*e, channel_env, std::strlen(channel_env)) != 0)
+            env.push_back(*e);
+    env.push_back(const_cast<char *>(assignment.c_str()));
+    env.push_back(nullptr);
+
+    pid_t const pid = ::fork();
+    if (pid < 0)
+    {
+        int const e = errno;
+        ::close(pair[0]);
+        ::close(pair[1]);
+        errno = e;
+        fail("upgrade fork");
+    }
+    if (pid == 0)
+    {
+        if (::dup2(pair[1], 3) < 0 || ::fcntl(3, F_SETFD, 0) != 0)
+            ::_exit(127);
+#ifdef SYS_close_range
+        if (::syscall(SYS_close_range, 4u, ~0u, 0u) != 0)
+#endif
+            for (long fd = 4, max = ::sysconf(_SC_OPEN_MAX); fd < max; fd++)
+                ::close(static_cast<int>(fd));
+        ::execvpe(argv[0], argv, env.data());
+        ::_exit(127);
+    }
+    ::close(pair[1]);
+    return {pid, pair[0]};
+}
+
+// The channel of the process we were handed over to, if any
+inline
+std::optional<int> inherited()
+{
+    char const * value = std::getenv(channel_env);
+    if (not value)
+        return std::nullopt;
+    int const channel = std::atoi(value);
+    ::unsetenv(channel_env);
+    return channel;
+}
+
+// Queues one message without blocking, false while the channel is full
+inline
+bool send(int channel, item const & it)
+{
+    std::string message(header_size, '\0');
+    message[0] = static_cast<char>(it.what);
+    message[1] = static_cast<char>(it.flags);
+    std::memcpy(&message[4], &it.tunnel, sizeof it.tunnel);
+    std::memcpy(&message[8], &it.value,  sizeof it.value);
+    message += it.data;
+    if (message.size() > max_message)
+        throw std::runtime_error("upgrade: message too long");
+
+    iovec iov {message.data(), message.size()};
+    msghdr msg {};
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+    if (it.fd >= 0)
+    {
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof control;
+        cmsghdr * cmsg     = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level   = SOL_SOCKET;
+        cmsg->cmsg_type    = SCM_RIGHTS;
+        cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &it.fd, sizeof(int));
+    }
+    ssize_t const n = ::sendmsg(channel, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n == static_cast<ssize_t>(message.size()))
+        return true;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return false;
+    fail("upgrade sendmsg");
+}
+
+inline
+item receive(int channel)
+{
+    char message[max_message];
+    iovec iov {message, sizeof message};
+    msghdr msg {};
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof control;
+
+    ssize_t const n = ::recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0)
+        fail("upgrade recvmsg");
+    if (static_cast<std::size_t>(n) < header_size)
+        throw std::runtime_error("upgrade: truncated message");
+
+    item it;
+    it.what  = static_cast<item::kind>(message[0]);
+    it.flags = static_cast<std::uint8_t>(message[1]);
+    std::memcpy(&it.tunnel, &message[4], sizeof it.tunnel);
+    std::memcpy(&it.value,  &message[8], sizeof it.value);
+    it.data.assign(message + header_size, n - header_size);
+    for (cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            std::memcpy(&it.fd, CMSG_DATA(cmsg), sizeof(int));
+    return it;
+}
+
+// Sends `items`, if any, and waits for the new process to answer with
+// `answer`, the io thread keeps serving meanwhile. A process that fails is
+// killed, half started it must not keep accepting on our sockets.
+inline
+lib::awaitable<void> converse(child const & c, std::vector<item> const * items, char answer,
+                              std::string const & failure, std::chrono::seconds timeout)
+{
+    auto executor = co_await lib::this_coro::executor();
+    auto token    = co_await lib::this_coro::token();
+
+    // only waits on the channel, `c` keeps owning it
+    boost::asio::posix::stream_descriptor channel{executor.context(), c.channel};
+    BOOST_SCOPE_EXIT (&channel) {
+        channel.release();
+    } BOOST_SCOPE_EXIT_END;
+    util::deadline const deadline{executor.context(), timeout, [&channel] {
+        boost::system::error_code ec;
+        channel.cancel(ec);
+    }};
+
+    std::exception_ptr error;
+    try
+    {
+        for (std::size_t i = 0; items && i <= items->size();)
+        {
+            if (send(c.channel, i < items->size()? (*items)[i]: item{}))
+                i++;
+            else
+                co_await channel.async_wait(boost::asio::posix::descriptor_base::wait_write, token);
+        }
+
+        char got = 0;
+        ssize_t n;
+        while ((n = ::recv(c.channel, &got, 1, MSG_DONTWAIT)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            co_await channel.async_wait(boost::asio::posix::descriptor_base::wait_read, token);
+        if (n != 1 || got != answer)
+            throw std::runtime_error(failure);
+    }
+    catch (boost::system::system_error const & e)
+    {
+        error = e.code() == boost::asio::error::operation_aborted?
+                std::make_exception_ptr(std::runtime_error(failure + " in time")):
+                std::current_exception();
+    }
+    catch (std::exception const &)
+    {
+        error = std::current_exception();
+    }
+    if (error)
+    {
+        ::kill(c.pid, SIGKILL);
+        ::waitpid(c.pid, nullptr, 0);
+        std::rethrow_exception(error);
+    }
+}
+
+// Waits until the new process is up and about to take the sockets over,
+// nothing needs to hold still for a slow start
+inline
+lib::awaitable<void> started(child const & c, std::chrono::seconds timeout)
+{
+    co_await converse(c, nullptr, started_signal, "upgrade: the new process did not start", timeout);
+}
+
+// Sends the sockets and waits until the new process has taken them over.
+// Until it says so, nothing changes for us.
+inline
+lib::awaitable<void> hand_over(child const & c, std::vector<item> const & items, std::chrono::seconds timeout)
+{
+    co_await converse(c, &items, taken_signal, "upgrade: the new process did not take over", timeout);
+}
+
+inline
+void tell(int channel, char what)
+{
+    if (::send(channel, &what, 1, MSG_NOSIGNAL) != 1)
+        fail("upgrade send");
+}
+
+// The new process: ready for the sockets
+inline
+void announce(int channel)
+{
+    tell(channel, started_signal);
+}
+
+// The new process: everything the old one handed over
+inline
+std::vector<item> take_over(int channel)
+{
+    std::vector<item> items;
+    for (item it = receive(channel); it.what != item::kind::done; it = receive(channel))
+        items.push_back(std::move(it));
+    return items;
+}
+
+inline
+void acknowledge(int channel)
+{
+    tell(channel, taken_signal);
+    ::close(channel);
+}
+
+// Protocols of a received descriptor, asio needs them to adopt it
+inline
+int family(int fd)
+{
+    sockaddr_storage addr {};
+    socklen_t size = sizeof addr;
+    if (::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &size) != 0)
+        fail("upgrade getsockname");
+    return addr.ss_family;
+}
+
+inline
+lib::tcp tcp_protocol(int fd)
+{
+    return family(fd) == AF_INET6? lib::tcp::v6(): lib::tcp::v4();
+}
+
+inline
+lib::generic generic_protocol(int fd)
+{
+    int const f = family(fd);
+    return {f, f == AF_UNIX? 0: static_cast<int>(IPPROTO_TCP)};
+}
+
+// The old process: lets the bridges run out, then stops
+inline
+lib::awaitable<void> drain(std::chrono::seconds deadline)
+{
+    using namespace std::chrono_literals;
+    auto executor = co_await lib::this_coro::executor();
+    auto token    = co_await lib::this_coro::token();
+
+    auto const until = std::chrono::steady_clock::now() + deadline;
+    boost::asio::steady_timer timer{executor.context()};
+    while (util::counted<bridge_tag>::live() && std::chrono::steady_clock::now() < until)
+    {
+        timer.expires_after(100ms);
+        co_await timer.async_wait(token);
+    }
+    std::cout << "upgrade: drained, " << util::counted<bridge_tag>::live() << " bridges cut at the deadline\n";
+    executor.context().stop();
+}
+
+// Hands `server` over to `c`, then drains. When that fails the old process
+// keeps serving and `retry` waits for the next signal.
+template<typename Server>
+lib::awaitable<void> replace(Server & server, child c, bool controls, std::chrono::seconds drain_deadline,
+                             std::function<void()> retry)
+{
+    BOOST_SCOPE_EXIT_ALL (&c) {
+        ::close(c.channel);
+    };
+    try
+    {
+        co_await server.hand_off(c, controls);
+    }
+    catch (std::exception const & e)
+    {
+        std::cerr << "upgrade failed, keeping on: " << e.what() << std::endl;
+        retry();
+        co_return;
+    }
+    std::cout << "upgrade: handed over to pid " << c.pid << ", draining bridges\n";
+    co_await drain(drain_deadline);
+}
+
+}// namespace pika::upgrade
+
+#endif // UPGRADE_HPP_